@@ -9,6 +9,60 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
+#include <algorithm>
+#include <initializer_list>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <climits>
+#include <chrono>
+#include <functional>
+#include <streambuf>
+#include <string_view>
+#include <type_traits>
+#include <cctype>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <pthread.h>
+#include <sched.h>
+#include <exception>
+#include <optional>
+#include <tuple>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define JNI_HELPER_HAS_SPAN 1
+#else
+#define JNI_HELPER_HAS_SPAN 0
+#endif
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define JNI_HELPER_HAS_IO_URING 1
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define JNI_HELPER_HAS_COROUTINES 1
+#else
+#define JNI_HELPER_HAS_COROUTINES 0
+#endif
 
 namespace jni {
     class JNIException : public std::runtime_error {
@@ -32,13 +86,245 @@ namespace jni {
             }                                                               \
         } while (0)
 
+    // Local reference accounting. Define JNI_HELPER_TRACK_LOCAL_REFS to count, per thread, the references
+    // this header creates, adopts and deletes, and to collect per-call-site high-water marks and leaks
+    // for every LocalRefScope. Without it the hooks are empty and compile away.
+    struct LocalRefSiteStats {
+        std::string site;
+        uint64_t calls = 0;
+        jint highWater = 0;   // most references live at once inside one call
+        uint64_t leaked = 0;  // references still live when calls returned, summed over calls
+    };
+
+    namespace detail {
+#ifdef JNI_HELPER_TRACK_LOCAL_REFS
+        class LocalRefTracker {
+        public:
+            static LocalRefTracker& Current() {
+                thread_local LocalRefTracker tracker;
+                return tracker;
+            }
+
+            // A helper returned a new reference the caller now owns
+            void Created(jobject ref) {
+                if (!ref) return;
+                pending_[ref] = sequence_++;
+                Grow();
+            }
+
+            // An owner took a reference; references returned by helpers are already counted
+            void Adopted(jobject ref) {
+                if (!ref || pending_.erase(ref)) return;
+                Grow();
+            }
+
+            // An owner gave up a reference without deleting it
+            void Released(jobject ref) {
+                if (ref) pending_[ref] = sequence_++;
+            }
+
+            void Deleted(jobject ref) {
+                if (!ref) return;
+                pending_.erase(ref);
+                if (live_ > 0) --live_;
+            }
+
+            void FramePushed() { frames_.push_back({live_, sequence_}); }
+
+            // Everything created since the matching push is gone, result is a new reference in the outer frame
+            void FramePopped(jobject result) {
+                if (frames_.empty()) return;
+                Frame frame = frames_.back();
+                frames_.pop_back();
+                for (auto it = pending_.begin(); it != pending_.end();) {
+                    it = it->second >= frame.sequence ? pending_.erase(it) : std::next(it);
+                }
+                live_ = frame.live;
+                Created(result);
+            }
+
+            void EnterScope() { scopes_.push_back({live_, live_}); }
+
+            // Returns {highWater, leaked} relative to the matching EnterScope
+            std::pair<jint, jint> LeaveScope() {
+                Scope scope = scopes_.back();
+                scopes_.pop_back();
+                if (!scopes_.empty()) scopes_.back().peak = std::max(scopes_.back().peak, scope.peak);
+                return {scope.peak - scope.start, std::max<jint>(live_ - scope.start, 0)};
+            }
+
+        private:
+            struct Frame {
+                jint live;
+                uint64_t sequence;
+            };
+
+            struct Scope {
+                jint start;
+                jint peak;
+            };
+
+            void Grow() {
+                ++live_;
+                if (!scopes_.empty()) scopes_.back().peak = std::max(scopes_.back().peak, live_);
+            }
+
+            jint live_ = 0;
+            uint64_t sequence_ = 0;
+            std::unordered_map<jobject, uint64_t> pending_;
+            std::vector<Frame> frames_;
+            std::vector<Scope> scopes_;
+        };
+
+        struct LocalRefSiteRegistry {
+            std::mutex mutex;
+            std::unordered_map<std::string, LocalRefSiteStats> sites;
+
+            static LocalRefSiteRegistry& Instance() {
+                static LocalRefSiteRegistry registry;
+                return registry;
+            }
+        };
+
+        inline void TrackLocalRefCreated(jobject ref) { LocalRefTracker::Current().Created(ref); }
+        inline void TrackLocalRefAdopted(jobject ref) { LocalRefTracker::Current().Adopted(ref); }
+        inline void TrackLocalRefReleased(jobject ref) { LocalRefTracker::Current().Released(ref); }
+        inline void TrackLocalRefDeleted(jobject ref) { LocalRefTracker::Current().Deleted(ref); }
+        inline void TrackLocalFramePushed() { LocalRefTracker::Current().FramePushed(); }
+        inline void TrackLocalFramePopped(jobject result) { LocalRefTracker::Current().FramePopped(result); }
+#else
+        inline void TrackLocalRefCreated(jobject) {}
+        inline void TrackLocalRefAdopted(jobject) {}
+        inline void TrackLocalRefReleased(jobject) {}
+        inline void TrackLocalRefDeleted(jobject) {}
+        inline void TrackLocalFramePushed() {}
+        inline void TrackLocalFramePopped(jobject) {}
+#endif
+
+        // Call-site key for LocalRefScope, placed first so JNI_LOCAL_REF_SCOPE can forward its arguments as they are
+        struct LocalRefSite {
+            const char* name;
+        };
+    } // namespace detail
+
+    // Make room for count more local references in the current frame.
+    // The 16 references every frame starts with may already be taken, so any positive request is forwarded.
+    inline void EnsureLocalCapacity(JNIEnv* env, jint count) {
+        if (count <= 0) return;
+        if (env->EnsureLocalCapacity(count) != JNI_OK) {
+            JNI_CHECK_EXCEPTION(env);
+            throw JNIException("EnsureLocalCapacity failed");
+        }
+    }
+
+    // Delete a local reference, keeping the tracked counts accurate
+    inline void DeleteLocalRef(JNIEnv* env, jobject ref) {
+        if (!ref) return;
+        detail::TrackLocalRefDeleted(ref);
+        env->DeleteLocalRef(ref);
+    }
+
+    // Marks one call site, usually a native method body. Entry reserves capacity for expectedRefs, or for
+    // the high-water mark the site has reached so far when tracking is enabled; exit records that
+    // mark and any references the call left behind.
+    class LocalRefScope {
+    public:
+        LocalRefScope(JNIEnv* env, const char* site, jint expectedRefs = 0) : site_(site) {
+#ifdef JNI_HELPER_TRACK_LOCAL_REFS
+            auto& registry = detail::LocalRefSiteRegistry::Instance();
+            {
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                auto it = registry.sites.find(site_);
+                if (it != registry.sites.end()) expectedRefs = std::max(expectedRefs, it->second.highWater);
+            }
+            detail::LocalRefTracker::Current().EnterScope();
+#endif
+            EnsureLocalCapacity(env, expectedRefs);
+        }
+
+        LocalRefScope(detail::LocalRefSite site, JNIEnv* env, jint expectedRefs = 0) : LocalRefScope(env, site.name, expectedRefs) {}
+
+        ~LocalRefScope() {
+#ifdef JNI_HELPER_TRACK_LOCAL_REFS
+            auto [highWater, leaked] = detail::LocalRefTracker::Current().LeaveScope();
+            auto& registry = detail::LocalRefSiteRegistry::Instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            LocalRefSiteStats& stats = registry.sites[site_];
+            stats.site = site_;
+            ++stats.calls;
+            stats.highWater = std::max(stats.highWater, highWater);
+            stats.leaked += static_cast<uint64_t>(leaked);
+#endif
+        }
+
+        // Disable copy
+        LocalRefScope(const LocalRefScope&) = delete;
+        LocalRefScope& operator=(const LocalRefScope&) = delete;
+
+    private:
+        const char* site_;
+    };
+
+#define JNI_HELPER_STRINGIFY_(x) #x
+#define JNI_HELPER_STRINGIFY(x) JNI_HELPER_STRINGIFY_(x)
+#define JNI_HELPER_CONCAT_(a, b) a##b
+#define JNI_HELPER_CONCAT(a, b) JNI_HELPER_CONCAT_(a, b)
+
+    // JNI_LOCAL_REF_SCOPE(env) or JNI_LOCAL_REF_SCOPE(env, expectedRefs), keyed by file and line
+#define JNI_LOCAL_REF_SCOPE(...) \
+        jni::LocalRefScope JNI_HELPER_CONCAT(jniLocalRefScope, __LINE__)( \
+                jni::detail::LocalRefSite{__FILE__ ":" JNI_HELPER_STRINGIFY(__LINE__)}, __VA_ARGS__)
+
+    // Per-site statistics collected so far, empty unless JNI_HELPER_TRACK_LOCAL_REFS is defined
+    inline std::vector<LocalRefSiteStats> LocalRefStats() {
+        std::vector<LocalRefSiteStats> result;
+#ifdef JNI_HELPER_TRACK_LOCAL_REFS
+        auto& registry = detail::LocalRefSiteRegistry::Instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const auto& entry : registry.sites) result.push_back(entry.second);
+        std::sort(result.begin(), result.end(), [](const LocalRefSiteStats& a, const LocalRefSiteStats& b) {
+            return a.highWater > b.highWater;
+        });
+#endif
+        return result;
+    }
+
+    // One line per site that leaked references, in "site: leaked N over M calls (high-water H)" form
+    inline std::string LocalRefLeakReport() {
+        std::string report;
+        for (const LocalRefSiteStats& stats : LocalRefStats()) {
+            if (stats.leaked == 0) continue;
+            report += stats.site + ": leaked " + std::to_string(stats.leaked) + " over " + std::to_string(stats.calls) +
+                      " calls (high-water " + std::to_string(stats.highWater) + ")\n";
+        }
+        return report;
+    }
+
+    inline void ResetLocalRefStats() {
+#ifdef JNI_HELPER_TRACK_LOCAL_REFS
+        auto& registry = detail::LocalRefSiteRegistry::Instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.sites.clear();
+#endif
+    }
+
     template <typename T>
     class ScopedLocalRef {
     public:
-        ScopedLocalRef(JNIEnv* env, T ref) : env_(env), ref_(ref) {}
+        ScopedLocalRef() : env_(nullptr), ref_(nullptr) {}
+        ScopedLocalRef(JNIEnv* env, T ref) : env_(env), ref_(ref) { detail::TrackLocalRefAdopted(ref_); }
 
         ~ScopedLocalRef() {
-            if (ref_) env_->DeleteLocalRef(ref_);
+            if (ref_) DeleteLocalRef(env_, ref_);
+        }
+
+        ScopedLocalRef(ScopedLocalRef&& other) noexcept : env_(other.env_), ref_(other.release()) {
+            detail::TrackLocalRefAdopted(ref_);
+        }
+
+        ScopedLocalRef& operator=(ScopedLocalRef&& other) noexcept {
+            if (this != &other) reset(other.env_, other.release());
+            return *this;
         }
 
         T get() const { return ref_; }
@@ -46,9 +332,28 @@ namespace jni {
         T release() {
             T temp = ref_;
             ref_ = nullptr;
+            detail::TrackLocalRefReleased(temp);
             return temp;
         }
 
+        // Delete the current reference and take ownership of ref, which needs an env set already
+        void reset(T ref = nullptr) {
+            if (ref && !env_) throw JNIException("ScopedLocalRef has no JNIEnv, use reset(env, ref)");
+            reset(env_, ref);
+        }
+
+        // Same as reset(ref), ref belongs to env from now on
+        void reset(JNIEnv* env, T ref) noexcept {
+            if (ref_ != ref) {
+                if (ref_) DeleteLocalRef(env_, ref_);
+                ref_ = ref;
+                detail::TrackLocalRefAdopted(ref_);
+            }
+            env_ = env;
+        }
+
+        explicit operator bool() const { return ref_ != nullptr; }
+
         // Disable copy
         ScopedLocalRef(const ScopedLocalRef&) = delete;
         ScopedLocalRef& operator=(const ScopedLocalRef&) = delete;
@@ -58,347 +363,940 @@ namespace jni {
         T ref_;
     };
 
-    inline std::string JStringToString(JNIEnv* env, jstring jstr) {
-        if (!jstr) return {};
-
-        const char* chars = env->GetStringUTFChars(jstr, nullptr);
-        if (!chars) return {};
+    // Owns a collection of local references and releases them together.
+    // By default they are deleted in one loop on destruction. WithFrame pushes a local frame instead,
+    // so every reference created while the vector is alive is released by a single PopLocalFrame;
+    // such vectors must be destroyed in LIFO order with other frames.
+    template <typename T>
+    class LocalRefVector {
+    public:
+        // Reserves room for reserve references both in the vector and in the current local frame
+        explicit LocalRefVector(JNIEnv* env, size_t reserve = 0) : env_(env) {
+            EnsureLocalCapacity(env, static_cast<jint>(std::min<size_t>(reserve, INT_MAX)));
+            refs_.reserve(reserve);
+        }
 
-        std::string result(chars);
-        env->ReleaseStringUTFChars(jstr, chars);
-        return result;
-    }
+        static LocalRefVector WithFrame(JNIEnv* env, jint capacity) {
+            if (env->PushLocalFrame(capacity) != JNI_OK) {
+                JNI_CHECK_EXCEPTION(env);
+                throw JNIException("PushLocalFrame failed");
+            }
+            detail::TrackLocalFramePushed();
 
-    inline jstring StringToJString(JNIEnv* env, const std::string& str) {
-        return env->NewStringUTF(str.c_str());
-    }
+            LocalRefVector result(env);
+            result.refs_.reserve(static_cast<size_t>(capacity));
+            result.framed_ = true;
+            return result;
+        }
 
-    inline jclass FindClass(JNIEnv* env, const char* className) {
-        jclass cls = env->FindClass(className);
-        JNI_CHECK_EXCEPTION(env);
-        return cls;
-    }
+        ~LocalRefVector() { clear(); }
 
-    inline jmethodID GetMethodID(JNIEnv* env, jclass cls, const char* methodName, const char* signature) {
-        jmethodID mid = env->GetMethodID(cls, methodName, signature);
-        JNI_CHECK_EXCEPTION(env);
-        return mid;
-    }
+        LocalRefVector(LocalRefVector&& other) noexcept
+                : env_(other.env_), refs_(std::move(other.refs_)), framed_(other.framed_) {
+            other.refs_.clear();
+            other.framed_ = false;
+        }
 
-    inline jmethodID GetStaticMethodID(JNIEnv* env, jclass cls, const char* methodName, const char* signature) {
-        jmethodID mid = env->GetStaticMethodID(cls, methodName, signature);
-        JNI_CHECK_EXCEPTION(env);
-        return mid;
-    }
+        LocalRefVector& operator=(LocalRefVector&& other) noexcept {
+            if (this != &other) {
+                clear();
+                env_ = other.env_;
+                refs_ = std::move(other.refs_);
+                framed_ = other.framed_;
+                other.refs_.clear();
+                other.framed_ = false;
+            }
+            return *this;
+        }
 
-    inline jfieldID GetFieldID(JNIEnv* env, jclass cls, const char* fieldName, const char* signature) {
-        jfieldID fid = env->GetFieldID(cls, fieldName, signature);
-        JNI_CHECK_EXCEPTION(env);
-        return fid;
-    }
+        // Disable copy
+        LocalRefVector(const LocalRefVector&) = delete;
+        LocalRefVector& operator=(const LocalRefVector&) = delete;
 
-    inline jfieldID GetStaticFieldID(JNIEnv* env, jclass cls, const char* fieldName, const char* signature) {
-        jfieldID fid = env->GetStaticFieldID(cls, fieldName, signature);
-        JNI_CHECK_EXCEPTION(env);
-        return fid;
-    }
+        void push_back(T ref) {
+            refs_.push_back(ref);
+            detail::TrackLocalRefAdopted(ref);
+        }
+        void push_back(ScopedLocalRef<T>&& ref) { push_back(ref.release()); }
 
-    template <typename T> struct JNITypeTraits;
+        T operator[](size_t index) const { return refs_[index]; }
+        size_t size() const { return refs_.size(); }
+        bool empty() const { return refs_.empty(); }
+        void reserve(size_t capacity) { refs_.reserve(capacity); }
 
-    // jobject
-    template <> struct JNITypeTraits<jobject> {
-        static constexpr const char* signature = "Ljava/lang/Object;";
+        typename std::vector<T>::const_iterator begin() const { return refs_.begin(); }
+        typename std::vector<T>::const_iterator end() const { return refs_.end(); }
 
-        // Fields
-        static jobject GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jobject result = env->GetObjectField(obj, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        // Release every reference, popping the frame for WithFrame vectors
+        void clear() {
+            if (framed_) {
+                env_->PopLocalFrame(nullptr);
+                detail::TrackLocalFramePopped(nullptr);
+                framed_ = false;
+            } else {
+                for (T ref : refs_) DeleteLocalRef(env_, ref);
+            }
+            refs_.clear();
         }
-        static jobject GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jobject result = env->GetStaticObjectField(cls, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+    private:
+        JNIEnv* env_;
+        std::vector<T> refs_;
+        bool framed_ = false;
+    };
+
+    // RAII scope for PushLocalFrame/PopLocalFrame
+    class LocalFrame {
+    public:
+        LocalFrame(JNIEnv* env, jint capacity) : env_(env) {
+            if (env_->PushLocalFrame(capacity) != JNI_OK) {
+                env_ = nullptr;
+                JNI_CHECK_EXCEPTION(env);
+                throw JNIException("PushLocalFrame failed");
+            }
+            detail::TrackLocalFramePushed();
         }
 
-        // Methods
-        static jobject CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jobject result = env->CallObjectMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        ~LocalFrame() { pop(); }
+
+        // Pop the frame early, returning result as a new local reference in the outer frame.
+        // Returns nullptr if the frame was already popped, result is then left untouched.
+        template <typename T>
+        T pop(T result) {
+            if (!env_) return nullptr;
+
+            JNIEnv* env = env_;
+            env_ = nullptr;
+            jobject outer = env->PopLocalFrame(result);
+            detail::TrackLocalFramePopped(outer);
+            return static_cast<T>(outer);
         }
-        static jobject CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jobject result = env->CallStaticObjectMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        void pop() {
+            if (!env_) return;
+            env_->PopLocalFrame(nullptr);
+            detail::TrackLocalFramePopped(nullptr);
+            env_ = nullptr;
         }
+
+        bool active() const { return env_ != nullptr; }
+
+        // Disable copy
+        LocalFrame(const LocalFrame&) = delete;
+        LocalFrame& operator=(const LocalFrame&) = delete;
+
+    private:
+        JNIEnv* env_;
     };
 
-    // jstring
-    template <> struct JNITypeTraits<jstring> {
-        static constexpr const char* signature = "Ljava/lang/String;";
+    // Keeps long loops inside bounded local frames by popping and re-pushing every chunk of iterations.
+    // Call next() at the end of every iteration with the number of local references it created;
+    // the chunk length adapts so each frame holds about targetRefs references.
+    class ChunkedLocalFrames {
+    public:
+        explicit ChunkedLocalFrames(JNIEnv* env, jint targetRefs = 256, jint expectedRefsPerIteration = 1)
+                : env_(env), targetRefs_(std::max<jint>(targetRefs, 1)) {
+            averageRefs_ = static_cast<double>(std::max<jint>(expectedRefsPerIteration, 1));
+            Retune();
+            Push();
+        }
 
-        // Fields
-        static jstring GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jstring result = static_cast<jstring>(env->GetObjectField(obj, fid));
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        ~ChunkedLocalFrames() {
+            if (pushed_) Pop();
         }
-        static jstring GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jstring result = static_cast<jstring>(env->GetStaticObjectField(cls, fid));
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        // Disable copy
+        ChunkedLocalFrames(const ChunkedLocalFrames&) = delete;
+        ChunkedLocalFrames& operator=(const ChunkedLocalFrames&) = delete;
+
+        void next(jint refsCreated = 1) {
+            used_ += refsCreated;
+            ++iterations_;
+            if (iterations_ < chunk_ && used_ + averageRefs_ <= capacity_) return;
+
+            // Exponential moving average of references per iteration over completed chunks
+            averageRefs_ = averageRefs_ * 0.5 + 0.5 * static_cast<double>(used_) / static_cast<double>(iterations_);
+            Pop();
+            Retune();
+            Push();
         }
 
-        // Methods
-        static jstring CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jstring result = static_cast<jstring>(env->CallObjectMethodA(obj, mid, args));
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        jint chunkSize() const { return chunk_; }
+        jint capacity() const { return capacity_; }
+
+    private:
+        void Retune() {
+            chunk_ = std::max<jint>(1, static_cast<jint>(targetRefs_ / std::max(averageRefs_, 1e-3)));
+            // Headroom for an iteration that creates more references than average
+            capacity_ = std::max<jint>(targetRefs_, static_cast<jint>(averageRefs_ * 2)) + 16;
         }
-        static jstring CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jstring result = static_cast<jstring>(env->CallStaticObjectMethodA(cls, mid, args));
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        void Push() {
+            if (env_->PushLocalFrame(capacity_) != JNI_OK) {
+                JNI_CHECK_EXCEPTION(env_);
+                throw JNIException("PushLocalFrame failed");
+            }
+            detail::TrackLocalFramePushed();
+            pushed_ = true;
+            used_ = 0;
+            iterations_ = 0;
+        }
+
+        void Pop() {
+            env_->PopLocalFrame(nullptr);
+            detail::TrackLocalFramePopped(nullptr);
+            pushed_ = false;
         }
+
+        JNIEnv* env_;
+        jint targetRefs_;
+        double averageRefs_ = 1;
+        jint chunk_ = 1;
+        jint capacity_ = 0;
+        jint used_ = 0;
+        jint iterations_ = 0;
+        bool pushed_ = false;
     };
 
-    // void
-    template <> struct JNITypeTraits<void> {
-        static constexpr const char* signature = "V";
+    namespace detail {
+        // Process-wide JavaVM, remembered from the first env seen so references can be released from any thread
+        inline std::atomic<JavaVM*>& CachedVM() {
+            static std::atomic<JavaVM*> vm{nullptr};
+            return vm;
+        }
 
-        // Methods
-        static void CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            env->CallVoidMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
+        inline void RememberVM(JNIEnv* env) {
+            if (CachedVM().load(std::memory_order_acquire)) return;
+
+            JavaVM* vm = nullptr;
+            if (env->GetJavaVM(&vm) == JNI_OK) CachedVM().store(vm, std::memory_order_release);
         }
-        static void CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            env->CallStaticVoidMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
+
+        // Run fn(env) on the current thread, attaching it temporarily if needed
+        template <typename Fn>
+        void WithAnyThreadEnv(Fn&& fn) {
+            JavaVM* vm = CachedVM().load(std::memory_order_acquire);
+            if (!vm) return;
+
+            JNIEnv* env = nullptr;
+            jint status = vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
+            if (status == JNI_OK) {
+                fn(env);
+            } else if (status == JNI_EDETACHED && vm->AttachCurrentThread(&env, nullptr) == JNI_OK) {
+                fn(env);
+                vm->DetachCurrentThread();
+            }
         }
+    } // namespace detail
+
+    // Process-wide JavaVM, normally set from JNI_OnLoad; helpers also remember it from the first env they see
+    inline void SetJavaVM(JavaVM* vm) { detail::CachedVM().store(vm, std::memory_order_release); }
+
+    inline JavaVM* GetJavaVM() { return detail::CachedVM().load(std::memory_order_acquire); }
+
+    // How Env() attaches a thread the first time it is called there
+    struct AttachOptions {
+        const char* threadName = nullptr;  // Null lets the VM pick a name
+        bool daemon = false;               // Daemon threads do not keep the VM alive
+        jobject group = nullptr;           // java.lang.ThreadGroup, null for the main group
     };
 
-    // jboolean
-    template <> struct JNITypeTraits<jboolean> {
-        static constexpr const char* signature = "Z";
+    namespace detail {
+        struct ThreadEnv {
+            JNIEnv* env = nullptr;
+            bool attachedHere = false;
+        };
 
-        // Fields
-        static jboolean GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jboolean result = env->GetBooleanField(obj, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        inline ThreadEnv& CurrentThreadEnv() {
+            thread_local ThreadEnv state;
+            return state;
         }
-        static jboolean GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jboolean result = env->GetStaticBooleanField(cls, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        // Detaches threads attached by Env() when they exit, the key value is the JavaVM
+        inline pthread_key_t DetachKey() {
+            static pthread_key_t key = [] {
+                pthread_key_t created;
+                if (pthread_key_create(&created, [](void* vm) {
+                        static_cast<JavaVM*>(vm)->DetachCurrentThread();
+                    }) != 0) {
+                    throw JNIException("pthread_key_create failed");
+                }
+                return created;
+            }();
+            return key;
         }
+    } // namespace detail
 
-        // Methods
-        static jboolean CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jboolean result = env->CallBooleanMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+    // JNIEnv of the calling thread, attaching it on first use and detaching it automatically at thread exit.
+    // Threads attached elsewhere are used as they are. The env is cached per thread, so threads using Env()
+    // must detach through jni::DetachCurrentThread rather than the raw JavaVM call.
+    inline JNIEnv* Env(const AttachOptions& options) {
+        detail::ThreadEnv& state = detail::CurrentThreadEnv();
+        if (state.env) return state.env;
+
+        JavaVM* vm = GetJavaVM();
+        if (!vm) throw JNIException("JavaVM not set, call jni::SetJavaVM from JNI_OnLoad");
+
+        JNIEnv* env = nullptr;
+        jint status = vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
+        if (status == JNI_EDETACHED) {
+            JavaVMAttachArgs args{JNI_VERSION_1_6, options.threadName, options.group};
+            status = options.daemon ? vm->AttachCurrentThreadAsDaemon(&env, &args) : vm->AttachCurrentThread(&env, &args);
+            if (status != JNI_OK) throw JNIException("AttachCurrentThread failed");
+
+            pthread_setspecific(detail::DetachKey(), vm);
+            state.attachedHere = true;
+        } else if (status != JNI_OK) {
+            throw JNIException("GetEnv failed");
         }
-        static jboolean CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jboolean result = env->CallStaticBooleanMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        state.env = env;
+        return env;
+    }
+
+    inline JNIEnv* Env() {
+        JNIEnv* env = detail::CurrentThreadEnv().env;
+        return env ? env : Env(AttachOptions{});
+    }
+
+    // Detach now instead of at thread exit, only threads attached by Env() are detached
+    inline void DetachCurrentThread() {
+        detail::ThreadEnv& state = detail::CurrentThreadEnv();
+        if (state.attachedHere) {
+            pthread_setspecific(detail::DetachKey(), nullptr);
+            GetJavaVM()->DetachCurrentThread();
         }
-    };
+        state = {};
+    }
 
-    // jbyte
-    template <> struct JNITypeTraits<jbyte> {
-        static constexpr const char* signature = "B";
+    // Move-only owner of a JNI global reference, releasable from any thread
+    template <typename T = jobject>
+    class GlobalRef {
+    public:
+        GlobalRef() = default;
 
-        // Fieldss
-        static jbyte GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jbyte result = env->GetByteField(obj, fid);
-            JNI_CHECK_EXCEPTION(env);
+        GlobalRef(JNIEnv* env, T ref) {
+            if (!ref) return;
+            detail::RememberVM(env);
+            ref_ = static_cast<T>(env->NewGlobalRef(ref));
+            if (!ref_) throw JNIException("NewGlobalRef failed");
+        }
+
+        // Adopt an existing global reference
+        static GlobalRef Adopt(JNIEnv* env, T globalRef) {
+            detail::RememberVM(env);
+            GlobalRef result;
+            result.ref_ = globalRef;
             return result;
         }
-        static jbyte GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jbyte result = env->GetStaticByteField(cls, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        ~GlobalRef() { reset(); }
+
+        GlobalRef(GlobalRef&& other) noexcept : ref_(other.release()) {}
+
+        GlobalRef& operator=(GlobalRef&& other) noexcept {
+            if (this != &other) {
+                reset();
+                ref_ = other.release();
+            }
+            return *this;
         }
 
-        // Methods
-        static jbyte CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jbyte result = env->CallByteMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        // Disable copy
+        GlobalRef(const GlobalRef&) = delete;
+        GlobalRef& operator=(const GlobalRef&) = delete;
+
+        T get() const { return ref_; }
+        explicit operator bool() const { return ref_ != nullptr; }
+
+        T release() {
+            T temp = ref_;
+            ref_ = nullptr;
+            return temp;
         }
-        static jbyte CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jbyte result = env->CallStaticByteMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        // Delete through the cached JavaVM, attaching this thread if necessary
+        void reset() {
+            if (!ref_) return;
+            T ref = release();
+            detail::WithAnyThreadEnv([ref](JNIEnv* env) { env->DeleteGlobalRef(ref); });
         }
+
+        // Delete with an env the caller already has
+        void reset(JNIEnv* env) {
+            if (ref_) env->DeleteGlobalRef(release());
+        }
+
+    private:
+        T ref_ = nullptr;
     };
 
-    // jchar
-    template <> struct JNITypeTraits<jchar> {
-        static constexpr const char* signature = "C";
+    // Move-only owner of a weak global reference
+    template <typename T = jobject>
+    class WeakRef {
+    public:
+        WeakRef() = default;
 
-        // Fields
-        static jchar GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jchar result = env->GetCharField(obj, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        WeakRef(JNIEnv* env, T ref) {
+            if (!ref) return;
+            detail::RememberVM(env);
+            ref_ = env->NewWeakGlobalRef(ref);
+            if (!ref_) throw JNIException("NewWeakGlobalRef failed");
         }
-        static jchar GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jchar result = env->GetStaticCharField(cls, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        ~WeakRef() { reset(); }
+
+        WeakRef(WeakRef&& other) noexcept : ref_(other.ref_) { other.ref_ = nullptr; }
+
+        WeakRef& operator=(WeakRef&& other) noexcept {
+            if (this != &other) {
+                reset();
+                ref_ = other.ref_;
+                other.ref_ = nullptr;
+            }
+            return *this;
         }
 
-        // Methods
-        static jchar CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jchar result = env->CallCharMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        // Disable copy
+        WeakRef(const WeakRef&) = delete;
+        WeakRef& operator=(const WeakRef&) = delete;
+
+        jweak get() const { return ref_; }
+        explicit operator bool() const { return ref_ != nullptr; }
+
+        // Strong local reference to the object, empty if it was collected
+        ScopedLocalRef<T> lock(JNIEnv* env) const {
+            if (!ref_) return ScopedLocalRef<T>(env, nullptr);
+            return ScopedLocalRef<T>(env, static_cast<T>(env->NewLocalRef(ref_)));
         }
-        static jchar CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jchar result = env->CallStaticCharMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        bool expired(JNIEnv* env) const { return !ref_ || env->IsSameObject(ref_, nullptr); }
+
+        void reset() {
+            if (!ref_) return;
+            jweak ref = ref_;
+            ref_ = nullptr;
+            detail::WithAnyThreadEnv([ref](JNIEnv* env) { env->DeleteWeakGlobalRef(ref); });
         }
+
+        void reset(JNIEnv* env) {
+            if (ref_) env->DeleteWeakGlobalRef(ref_);
+            ref_ = nullptr;
+        }
+
+    private:
+        jweak ref_ = nullptr;
     };
 
-    // jshort
-    template <> struct JNITypeTraits<jshort> {
-        static constexpr const char* signature = "S";
+    // Copyable global reference sharing one NewGlobalRef through an atomic reference count.
+    // Copies never enter the VM, the last owner deletes the reference from whatever thread it runs on.
+    template <typename T = jobject>
+    class SharedGlobalRef {
+    public:
+        SharedGlobalRef() = default;
 
-        // Fields
-        static jshort GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jshort result = env->GetShortField(obj, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        SharedGlobalRef(JNIEnv* env, T ref) {
+            if (!ref) return;
+            GlobalRef<T> global(env, ref);
+            control_ = new Control{global.release(), {1}};
         }
-        static jshort GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jshort result = env->GetStaticShortField(cls, fid);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        explicit SharedGlobalRef(GlobalRef<T>&& global) {
+            if (!global) return;
+            control_ = new Control{global.release(), {1}};
         }
 
-        // Methods
-        static jshort CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jshort result = env->CallShortMethodA(obj, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+        ~SharedGlobalRef() { reset(); }
+
+        SharedGlobalRef(const SharedGlobalRef& other) noexcept : control_(other.control_) {
+            if (control_) control_->count.fetch_add(1, std::memory_order_relaxed);
         }
-        static jshort CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jshort result = env->CallStaticShortMethodA(cls, mid, args);
-            JNI_CHECK_EXCEPTION(env);
-            return result;
+
+        SharedGlobalRef(SharedGlobalRef&& other) noexcept : control_(other.control_) { other.control_ = nullptr; }
+
+        SharedGlobalRef& operator=(const SharedGlobalRef& other) noexcept {
+            SharedGlobalRef(other).swap(*this);
+            return *this;
+        }
+
+        SharedGlobalRef& operator=(SharedGlobalRef&& other) noexcept {
+            SharedGlobalRef(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        void swap(SharedGlobalRef& other) noexcept { std::swap(control_, other.control_); }
+
+        T get() const { return control_ ? control_->ref : nullptr; }
+        explicit operator bool() const { return control_ != nullptr; }
+        size_t use_count() const { return control_ ? control_->count.load(std::memory_order_relaxed) : 0; }
+
+        void reset() {
+            Control* control = control_;
+            control_ = nullptr;
+            if (!control || control->count.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+            T ref = control->ref;
+            delete control;
+            detail::WithAnyThreadEnv([ref](JNIEnv* env) { env->DeleteGlobalRef(ref); });
         }
+
+    private:
+        struct Control {
+            T ref;
+            std::atomic<size_t> count;
+        };
+
+        Control* control_ = nullptr;
     };
 
-    // jint
-    template <> struct JNITypeTraits<jint> {
-        static constexpr const char* signature = "I";
+    inline std::string JStringToString(JNIEnv* env, jstring jstr) {
+        if (!jstr) return {};
 
-        // Fields
-        static jint GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jint result = env->GetIntField(obj, fid);
+        const char* chars = env->GetStringUTFChars(jstr, nullptr);
+        if (!chars) return {};
+
+        std::string result(chars);
+        env->ReleaseStringUTFChars(jstr, chars);
+        return result;
+    }
+
+    inline jstring StringToJString(JNIEnv* env, const std::string& str) {
+        jstring result = env->NewStringUTF(str.c_str());
+        detail::TrackLocalRefCreated(result);
+        return result;
+    }
+
+    namespace detail {
+        // Application class loader captured by CaptureClassLoader, consulted when FindClass cannot see a class,
+        // as on natively attached threads where FindClass only searches the system loader
+        struct ClassLoaderState {
+            std::atomic<jobject> loader{nullptr};  // Global reference
+            std::atomic<jmethodID> loadClass{nullptr};
+
+            static ClassLoaderState& Instance() {
+                static ClassLoaderState state;
+                return state;
+            }
+        };
+
+        // ClassLoader.loadClass, resolved once; virtual dispatch makes it valid for every loader
+        inline jmethodID LoadClassMethod(JNIEnv* env) {
+            auto& state = ClassLoaderState::Instance();
+            jmethodID mid = state.loadClass.load(std::memory_order_acquire);
+            if (mid) return mid;
+
+            jclass loaderClass = env->FindClass("java/lang/ClassLoader");
             JNI_CHECK_EXCEPTION(env);
-            return result;
-        }
-        static jint GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jint result = env->GetStaticIntField(cls, fid);
+            ScopedLocalRef<jclass> loaderClassRef(env, loaderClass);
+
+            mid = env->GetMethodID(loaderClass, "loadClass", "(Ljava/lang/String;)Ljava/lang/Class;");
             JNI_CHECK_EXCEPTION(env);
-            return result;
+            state.loadClass.store(mid, std::memory_order_release);
+            return mid;
         }
 
-        // Methods
-        static jint CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jint result = env->CallIntMethodA(obj, mid, args);
+        // loader.loadClass with a JNI name such as "com/example/Foo"
+        inline jclass LoadClassThrough(JNIEnv* env, jobject loader, const char* className) {
+            jmethodID loadClass = LoadClassMethod(env);
+
+            std::string binaryName(className);
+            std::replace(binaryName.begin(), binaryName.end(), '/', '.');
+            ScopedLocalRef<jstring> name(env, env->NewStringUTF(binaryName.c_str()));
             JNI_CHECK_EXCEPTION(env);
-            return result;
+
+            jclass cls = static_cast<jclass>(env->CallObjectMethod(loader, loadClass, name.get()));
+            JNI_CHECK_EXCEPTION(env);
+            return cls;
         }
-        static jint CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jint result = env->CallStaticIntMethodA(cls, mid, args);
+
+        // FindClass, retried through the application loader when one was captured
+        inline jclass FindClassWithFallback(JNIEnv* env, const char* className) {
+            jclass cls = env->FindClass(className);
+            jobject loader = ClassLoaderState::Instance().loader.load(std::memory_order_acquire);
+            // loadClass does not resolve array descriptors
+            if (!cls && loader && className[0] != '[') {
+                env->ExceptionClear();
+                cls = LoadClassThrough(env, loader, className);
+            }
             JNI_CHECK_EXCEPTION(env);
-            return result;
+            return cls;
         }
-    };
 
-    // jlong
-    template <> struct JNITypeTraits<jlong> {
-        static constexpr const char* signature = "J";
+        // Cached resolution through ClassIdCache, defined after it
+        inline jclass ResolveClass(JNIEnv* env, const char* className);
+    } // namespace detail
+
+    // Use loader for classes FindClass cannot see. Call before other threads resolve classes, usually from JNI_OnLoad.
+    inline void SetClassLoader(JNIEnv* env, jobject loader) {
+        detail::RememberVM(env);
+        jobject global = loader ? env->NewGlobalRef(loader) : nullptr;
+        if (loader && !global) throw JNIException("NewGlobalRef failed");
+
+        detail::LoadClassMethod(env);
+        jobject previous = detail::ClassLoaderState::Instance().loader.exchange(global, std::memory_order_acq_rel);
+        if (previous) env->DeleteGlobalRef(previous);
+    }
+
+    // Capture the loader of an application class, from JNI_OnLoad where FindClass still sees application classes
+    inline void CaptureClassLoader(JNIEnv* env, const char* anchorClassName) {
+        jclass cls = env->FindClass(anchorClassName);
+        JNI_CHECK_EXCEPTION(env);
+        ScopedLocalRef<jclass> clsRef(env, cls);
+
+        jclass classClass = env->GetObjectClass(cls);
+        ScopedLocalRef<jclass> classClassRef(env, classClass);
+        jmethodID getClassLoader = env->GetMethodID(classClass, "getClassLoader", "()Ljava/lang/ClassLoader;");
+        JNI_CHECK_EXCEPTION(env);
+
+        ScopedLocalRef<jobject> loader(env, env->CallObjectMethod(cls, getClassLoader));
+        JNI_CHECK_EXCEPTION(env);
+        SetClassLoader(env, loader.get());
+    }
+
+    // The captured application loader as a global reference, or null
+    inline jobject GetClassLoader() {
+        return detail::ClassLoaderState::Instance().loader.load(std::memory_order_acquire);
+    }
+
+    // Once an application loader is captured, classes resolve through ClassIdCache: FindClass with the
+    // loader as fallback, once per class per process
+    inline jclass FindClass(JNIEnv* env, const char* className) {
+        if (GetClassLoader()) return detail::ResolveClass(env, className);
+
+        jclass cls = env->FindClass(className);
+        JNI_CHECK_EXCEPTION(env);
+        detail::TrackLocalRefCreated(cls);
+        return cls;
+    }
+
+    inline jmethodID GetMethodID(JNIEnv* env, jclass cls, const char* methodName, const char* signature) {
+        jmethodID mid = env->GetMethodID(cls, methodName, signature);
+        JNI_CHECK_EXCEPTION(env);
+        return mid;
+    }
+
+    inline jmethodID GetStaticMethodID(JNIEnv* env, jclass cls, const char* methodName, const char* signature) {
+        jmethodID mid = env->GetStaticMethodID(cls, methodName, signature);
+        JNI_CHECK_EXCEPTION(env);
+        return mid;
+    }
+
+    inline jfieldID GetFieldID(JNIEnv* env, jclass cls, const char* fieldName, const char* signature) {
+        jfieldID fid = env->GetFieldID(cls, fieldName, signature);
+        JNI_CHECK_EXCEPTION(env);
+        return fid;
+    }
+
+    inline jfieldID GetStaticFieldID(JNIEnv* env, jclass cls, const char* fieldName, const char* signature) {
+        jfieldID fid = env->GetStaticFieldID(cls, fieldName, signature);
+        JNI_CHECK_EXCEPTION(env);
+        return fid;
+    }
+
+    template <typename T> struct JNITypeTraits;
+
+    // jobject
+    template <> struct JNITypeTraits<jobject> {
+        static constexpr const char* signature = "Ljava/lang/Object;";
 
         // Fields
-        static jlong GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jlong result = env->GetLongField(obj, fid);
+        static jobject GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jobject result = env->GetObjectField(obj, fid);
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
-        static jlong GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jlong result = env->GetStaticLongField(cls, fid);
+        static jobject GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jobject result = env->GetStaticObjectField(cls, fid);
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
 
         // Methods
-        static jlong CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jlong result = env->CallLongMethodA(obj, mid, args);
+        static jobject CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jobject result = env->CallObjectMethodA(obj, mid, args);
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
-        static jlong CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jlong result = env->CallStaticLongMethodA(cls, mid, args);
+        static jobject CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jobject result = env->CallStaticObjectMethodA(cls, mid, args);
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
     };
 
-    // jfloat
-    template <> struct JNITypeTraits<jfloat> {
-        static constexpr const char* signature = "F";
+    // jstring
+    template <> struct JNITypeTraits<jstring> {
+        static constexpr const char* signature = "Ljava/lang/String;";
 
         // Fields
-        static jfloat GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jfloat result = env->GetFloatField(obj, fid);
+        static jstring GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jstring result = static_cast<jstring>(env->GetObjectField(obj, fid));
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
-        static jfloat GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jfloat result = env->GetStaticFloatField(cls, fid);
+        static jstring GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jstring result = static_cast<jstring>(env->GetStaticObjectField(cls, fid));
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
 
         // Methods
-        static jfloat CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
-            jfloat result = env->CallFloatMethodA(obj, mid, args);
+        static jstring CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jstring result = static_cast<jstring>(env->CallObjectMethodA(obj, mid, args));
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
-        static jfloat CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
-            jfloat result = env->CallStaticFloatMethodA(cls, mid, args);
+        static jstring CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jstring result = static_cast<jstring>(env->CallStaticObjectMethodA(cls, mid, args));
             JNI_CHECK_EXCEPTION(env);
+            detail::TrackLocalRefCreated(result);
             return result;
         }
     };
 
-    // jdouble
-    template <> struct JNITypeTraits<jdouble> {
-        static constexpr const char* signature = "D";
+    // void
+    template <> struct JNITypeTraits<void> {
+        static constexpr const char* signature = "V";
 
-        // Fields
-        static jdouble GetField(JNIEnv* env, jobject obj, jfieldID fid) {
-            jdouble result = env->GetDoubleField(obj, fid);
+        // Methods
+        static void CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            env->CallVoidMethodA(obj, mid, args);
             JNI_CHECK_EXCEPTION(env);
-            return result;
         }
-        static jdouble GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
-            jdouble result = env->GetStaticDoubleField(cls, fid);
+        static void CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            env->CallStaticVoidMethodA(cls, mid, args);
             JNI_CHECK_EXCEPTION(env);
-            return result;
         }
+    };
 
-        // Methods
-        static jdouble CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+    // jboolean
+    template <> struct JNITypeTraits<jboolean> {
+        static constexpr const char* signature = "Z";
+
+        // Fields
+        static jboolean GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jboolean result = env->GetBooleanField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jboolean GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jboolean result = env->GetStaticBooleanField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jboolean CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jboolean result = env->CallBooleanMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jboolean CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jboolean result = env->CallStaticBooleanMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jbyte
+    template <> struct JNITypeTraits<jbyte> {
+        static constexpr const char* signature = "B";
+
+        // Fieldss
+        static jbyte GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jbyte result = env->GetByteField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jbyte GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jbyte result = env->GetStaticByteField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jbyte CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jbyte result = env->CallByteMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jbyte CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jbyte result = env->CallStaticByteMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jchar
+    template <> struct JNITypeTraits<jchar> {
+        static constexpr const char* signature = "C";
+
+        // Fields
+        static jchar GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jchar result = env->GetCharField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jchar GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jchar result = env->GetStaticCharField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jchar CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jchar result = env->CallCharMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jchar CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jchar result = env->CallStaticCharMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jshort
+    template <> struct JNITypeTraits<jshort> {
+        static constexpr const char* signature = "S";
+
+        // Fields
+        static jshort GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jshort result = env->GetShortField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jshort GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jshort result = env->GetStaticShortField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jshort CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jshort result = env->CallShortMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jshort CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jshort result = env->CallStaticShortMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jint
+    template <> struct JNITypeTraits<jint> {
+        static constexpr const char* signature = "I";
+
+        // Fields
+        static jint GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jint result = env->GetIntField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jint GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jint result = env->GetStaticIntField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jint CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jint result = env->CallIntMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jint CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jint result = env->CallStaticIntMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jlong
+    template <> struct JNITypeTraits<jlong> {
+        static constexpr const char* signature = "J";
+
+        // Fields
+        static jlong GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jlong result = env->GetLongField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jlong GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jlong result = env->GetStaticLongField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jlong CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jlong result = env->CallLongMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jlong CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jlong result = env->CallStaticLongMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jfloat
+    template <> struct JNITypeTraits<jfloat> {
+        static constexpr const char* signature = "F";
+
+        // Fields
+        static jfloat GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jfloat result = env->GetFloatField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jfloat GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jfloat result = env->GetStaticFloatField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jfloat CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
+            jfloat result = env->CallFloatMethodA(obj, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jfloat CallStaticMethod(JNIEnv* env, jclass cls, jmethodID mid, const jvalue* args) {
+            jfloat result = env->CallStaticFloatMethodA(cls, mid, args);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+    };
+
+    // jdouble
+    template <> struct JNITypeTraits<jdouble> {
+        static constexpr const char* signature = "D";
+
+        // Fields
+        static jdouble GetField(JNIEnv* env, jobject obj, jfieldID fid) {
+            jdouble result = env->GetDoubleField(obj, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static jdouble GetStaticField(JNIEnv* env, jclass cls, jfieldID fid) {
+            jdouble result = env->GetStaticDoubleField(cls, fid);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+
+        // Methods
+        static jdouble CallMethod(JNIEnv* env, jobject obj, jmethodID mid, const jvalue* args) {
             jdouble result = env->CallDoubleMethodA(obj, mid, args);
             JNI_CHECK_EXCEPTION(env);
             return result;
@@ -414,15 +1312,31 @@ namespace jni {
     template <typename... Args>
     class ArgsToJValues {
     public:
-        ArgsToJValues(JNIEnv* env, Args... args) {
+        ArgsToJValues(JNIEnv* env, Args... args) : env_(env) {
             convertArgs(env, 0, args...);
         }
 
+        // Strings converted for the call are deleted once it returns
+        ~ArgsToJValues() {
+            for (size_t i = 0; i < temporaryCount_; ++i) DeleteLocalRef(env_, temporaries_[i]);
+        }
+
+        ArgsToJValues(const ArgsToJValues&) = delete;
+        ArgsToJValues& operator=(const ArgsToJValues&) = delete;
+
         const jvalue* get() const { return values_; }
 
     private:
         // Make sure we have at least one element in the array
         jvalue values_[sizeof...(Args) > 0 ? sizeof...(Args) : 1];
+        JNIEnv* env_;
+        jobject temporaries_[sizeof...(Args) > 0 ? sizeof...(Args) : 1];
+        size_t temporaryCount_ = 0;
+
+        void setTemporary(int index, jobject ref) {
+            values_[index].l = ref;
+            if (ref) temporaries_[temporaryCount_++] = ref;
+        }
 
         template <typename T, typename... RestArgs>
         void convertArgs(JNIEnv* env, int index, T value, RestArgs... rest) {
@@ -457,8 +1371,7 @@ namespace jni {
 
         // Handle C++ string conversion to Java string
         void setJValue(JNIEnv* env, int index, const std::string& value) {
-            jstring jstr = StringToJString(env, value);
-            values_[index].l = jstr;
+            setTemporary(index, StringToJString(env, value));
         }
 
         void setJValue(JNIEnv* env, int index, const char* value) {
@@ -466,7 +1379,8 @@ namespace jni {
                 values_[index].l = nullptr;
             } else {
                 jstring jstr = env->NewStringUTF(value);
-                values_[index].l = jstr;
+                detail::TrackLocalRefCreated(jstr);
+                setTemporary(index, jstr);
             }
         }
     };
@@ -528,6 +1442,7 @@ namespace jni {
             else if constexpr (std::is_same_v<RetType, jstring> || std::is_convertible_v<RetType, jobject>) {
                 RetType result = static_cast<RetType>(env->CallObjectMethod(obj, mid));
                 JNI_CHECK_EXCEPTION(env);
+                detail::TrackLocalRefCreated(result);
                 return result;
             }
             else {
@@ -600,6 +1515,7 @@ namespace jni {
             else if constexpr (std::is_same_v<RetType, jstring> || std::is_convertible_v<RetType, jobject>) {
                 RetType result = static_cast<RetType>(env->CallStaticObjectMethod(cls, mid));
                 JNI_CHECK_EXCEPTION(env);
+                detail::TrackLocalRefCreated(result);
                 return result;
             }
             else {
@@ -625,6 +1541,7 @@ namespace jni {
         ArgsToJValues<Args...> jvalues(env, args...);
         jobject obj = env->NewObjectA(cls, constructor, jvalues.get());
         JNI_CHECK_EXCEPTION(env);
+        detail::TrackLocalRefCreated(obj);
 
         return obj;
     }
@@ -658,4 +1575,4458 @@ namespace jni {
             return JNITypeTraits<T>::GetStaticField(env, cls, fid);
         }
     }
+
+    // Overloads using the calling thread's Env()
+    template <typename RetType, typename... Args>
+    RetType CallMethod(jobject obj, const char* methodName, const char* signature, Args... args) {
+        return CallMethod<RetType>(Env(), obj, methodName, signature, args...);
+    }
+
+    template <typename RetType, typename... Args>
+    RetType CallStaticMethod(const char* className, const char* methodName, const char* signature, Args... args) {
+        return CallStaticMethod<RetType>(Env(), className, methodName, signature, args...);
+    }
+
+    template <typename... Args>
+    jobject NewObject(const char* className, const char* constructorSignature, Args... args) {
+        return NewObject(Env(), className, constructorSignature, args...);
+    }
+
+    template <typename T>
+    T GetField(jobject obj, const char* fieldName, const char* signature = nullptr) {
+        return GetField<T>(Env(), obj, fieldName, signature);
+    }
+
+    template <typename T>
+    T GetStaticField(const char* className, const char* fieldName, const char* signature = nullptr) {
+        return GetStaticField<T>(Env(), className, fieldName, signature);
+    }
+
+    // Class, method and field IDs cached without pinning class loaders. Classes are held through weak
+    // global references next to their defining loader, so an unloaded plugin loader can still be
+    // collected. Evictions bump a generation counter, which CachedMethodID/CachedFieldID compare to
+    // skip every lookup while nothing changed; call InvalidateLoader when tearing a loader down.
+    class ClassIdCache {
+    public:
+        static ClassIdCache& Instance() {
+            static ClassIdCache cache;
+            return cache;
+        }
+
+        // Local reference to the class, resolved with FindClass (falling back to the application loader), or
+        // loader.loadClass, on first use
+        ScopedLocalRef<jclass> GetClass(JNIEnv* env, const char* className, jobject loader = nullptr) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (Entry* entry = Find(env, className, loader)) {
+                    jclass cls = static_cast<jclass>(env->NewLocalRef(entry->cls));
+                    if (cls) return ScopedLocalRef<jclass>(env, cls);
+                    Evict(env, className, entry);
+                }
+            }
+
+            // Resolve outside the lock, class initialization may call back into native code
+            ScopedLocalRef<jclass> cls(env, LoadClass(env, className, loader));
+            ScopedLocalRef<jobject> definingLoader(env, CallMethod<jobject>(env, cls.get(), "getClassLoader",
+                                                                            "()Ljava/lang/ClassLoader;"));
+
+            auto entry = std::make_unique<Entry>();
+            try {
+                entry->cls = NewWeak(env, cls.get());
+                entry->loader = NewWeak(env, definingLoader.get());
+                entry->requestedLoader = NewWeak(env, loader);
+            } catch (...) {
+                Release(env, *entry);
+                throw;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (Find(env, className, loader)) {
+                Release(env, *entry);
+            } else {
+                entries_[className].push_back(std::move(entry));
+            }
+            return cls;
+        }
+
+        template <typename Id>
+        Id GetMemberID(JNIEnv* env, const char* className, const char* name, const char* signature, bool isStatic,
+                       jobject loader = nullptr) {
+            std::string key = std::string(name) + '\0' + signature + (isStatic ? 'S' : 'I');
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (Entry* entry = Find(env, className, loader)) {
+                    if (env->IsSameObject(entry->cls, nullptr)) {
+                        // Unloaded, its IDs are dangling; a reloaded class gets a fresh entry below
+                        Evict(env, className, entry);
+                    } else {
+                        auto& ids = Ids<Id>(*entry);
+                        auto it = ids.find(key);
+                        if (it != ids.end()) return it->second;
+                    }
+                }
+            }
+
+            ScopedLocalRef<jclass> cls = GetClass(env, className, loader);
+            Id id;
+            if constexpr (std::is_same_v<Id, jmethodID>) {
+                id = isStatic ? jni::GetStaticMethodID(env, cls.get(), name, signature)
+                              : jni::GetMethodID(env, cls.get(), name, signature);
+            } else {
+                id = isStatic ? jni::GetStaticFieldID(env, cls.get(), name, signature)
+                              : jni::GetFieldID(env, cls.get(), name, signature);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (Entry* entry = Find(env, className, loader)) Ids<Id>(*entry).emplace(std::move(key), id);
+            return id;
+        }
+
+        jmethodID GetMethodID(JNIEnv* env, const char* className, const char* name, const char* signature,
+                              jobject loader = nullptr) {
+            return GetMemberID<jmethodID>(env, className, name, signature, false, loader);
+        }
+
+        jmethodID GetStaticMethodID(JNIEnv* env, const char* className, const char* name, const char* signature,
+                                    jobject loader = nullptr) {
+            return GetMemberID<jmethodID>(env, className, name, signature, true, loader);
+        }
+
+        jfieldID GetFieldID(JNIEnv* env, const char* className, const char* name, const char* signature,
+                            jobject loader = nullptr) {
+            return GetMemberID<jfieldID>(env, className, name, signature, false, loader);
+        }
+
+        jfieldID GetStaticFieldID(JNIEnv* env, const char* className, const char* name, const char* signature,
+                                  jobject loader = nullptr) {
+            return GetMemberID<jfieldID>(env, className, name, signature, true, loader);
+        }
+
+        // Drop every entry defined by or requested through loader, and entries whose loader was collected
+        void InvalidateLoader(JNIEnv* env, jobject loader) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            RemoveIf(env, [env, loader](const Entry& entry) {
+                return IsDeadOrSame(env, entry.loader, loader) || IsDeadOrSame(env, entry.requestedLoader, loader);
+            });
+        }
+
+        // Drop entries whose class has been unloaded, returns how many were removed
+        size_t Sweep(JNIEnv* env) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return RemoveIf(env, [env](const Entry& entry) { return env->IsSameObject(entry.cls, nullptr); });
+        }
+
+        void Clear(JNIEnv* env) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            RemoveIf(env, [](const Entry&) { return true; });
+            generation_.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+    private:
+        struct Entry {
+            jweak cls = nullptr;
+            jweak loader = nullptr;           // Defining loader, null for the boot loader
+            jweak requestedLoader = nullptr;  // Loader passed to the lookup, null for FindClass
+            std::unordered_map<std::string, jmethodID> methods;
+            std::unordered_map<std::string, jfieldID> fields;
+        };
+
+        ClassIdCache() = default;
+
+        static jclass LoadClass(JNIEnv* env, const char* className, jobject loader) {
+            return loader ? detail::LoadClassThrough(env, loader, className) : detail::FindClassWithFallback(env, className);
+        }
+
+        static jweak NewWeak(JNIEnv* env, jobject obj) {
+            if (!obj) return nullptr;
+            jweak weak = env->NewWeakGlobalRef(obj);
+            if (!weak) throw JNIException("NewWeakGlobalRef failed");
+            return weak;
+        }
+
+        static bool IsDeadOrSame(JNIEnv* env, jweak weak, jobject loader) {
+            return weak && (env->IsSameObject(weak, nullptr) || env->IsSameObject(weak, loader));
+        }
+
+        template <typename Id>
+        static std::unordered_map<std::string, Id>& Ids(Entry& entry) {
+            if constexpr (std::is_same_v<Id, jmethodID>) {
+                return entry.methods;
+            } else {
+                return entry.fields;
+            }
+        }
+
+        Entry* Find(JNIEnv* env, const char* className, jobject loader) {
+            auto it = entries_.find(className);
+            if (it == entries_.end()) return nullptr;
+
+            for (auto& entry : it->second) {
+                if (loader ? entry->requestedLoader && env->IsSameObject(entry->requestedLoader, loader)
+                           : !entry->requestedLoader) {
+                    return entry.get();
+                }
+            }
+            return nullptr;
+        }
+
+        void Evict(JNIEnv* env, const char* className, Entry* stale) {
+            auto& bucket = entries_[className];
+            for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+                if (it->get() != stale) continue;
+                Release(env, **it);
+                bucket.erase(it);
+                generation_.fetch_add(1, std::memory_order_acq_rel);
+                return;
+            }
+        }
+
+        template <typename Predicate>
+        size_t RemoveIf(JNIEnv* env, Predicate&& predicate) {
+            size_t removed = 0;
+            for (auto bucket = entries_.begin(); bucket != entries_.end();) {
+                auto& list = bucket->second;
+                for (auto it = list.begin(); it != list.end();) {
+                    if (!predicate(**it)) {
+                        ++it;
+                        continue;
+                    }
+                    Release(env, **it);
+                    it = list.erase(it);
+                    ++removed;
+                }
+                bucket = list.empty() ? entries_.erase(bucket) : std::next(bucket);
+            }
+            if (removed) generation_.fetch_add(1, std::memory_order_acq_rel);
+            return removed;
+        }
+
+        static void Release(JNIEnv* env, Entry& entry) {
+            if (entry.cls) env->DeleteWeakGlobalRef(entry.cls);
+            if (entry.loader) env->DeleteWeakGlobalRef(entry.loader);
+            if (entry.requestedLoader) env->DeleteWeakGlobalRef(entry.requestedLoader);
+        }
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::vector<std::unique_ptr<Entry>>> entries_;
+        std::atomic<uint64_t> generation_{1};
+    };
+
+    // Drop-in for a hand-rolled static jmethodID/jfieldID, resolved through ClassIdCache with FindClass.
+    // get() is three atomic loads and an IsSameObject on the class while the cache generation is unchanged.
+    template <typename Id>
+    class CachedMemberID {
+    public:
+        CachedMemberID(const char* className, const char* name, const char* signature, bool isStatic = false)
+                : className_(className), name_(name), signature_(signature), isStatic_(isStatic) {}
+
+        Id get(JNIEnv* env) {
+            ClassIdCache& cache = ClassIdCache::Instance();
+            uint64_t generation = cache.generation();
+            if (generation_.load(std::memory_order_acquire) == generation) {
+                jweak cls = class_.load(std::memory_order_relaxed);
+                if (!env->IsSameObject(cls, nullptr)) return id_.load(std::memory_order_relaxed);
+            }
+
+            Id id = cache.GetMemberID<Id>(env, className_, name_, signature_, isStatic_);
+            ScopedLocalRef<jclass> cls = cache.GetClass(env, className_);
+
+            // Publish only if no eviction happened meanwhile, a later get() retries otherwise
+            std::lock_guard<std::mutex> lock(publishMutex_);
+            if (cache.generation() == generation && (generation_.load(std::memory_order_relaxed) != generation ||
+                                                     env->IsSameObject(class_.load(std::memory_order_relaxed), nullptr))) {
+                // Readers may still hold the previous weak reference, it lives as long as this object
+                classes_.emplace_back(env, cls.get());
+                id_.store(id, std::memory_order_relaxed);
+                class_.store(classes_.back().get(), std::memory_order_relaxed);
+                generation_.store(generation, std::memory_order_release);
+            }
+            return id;
+        }
+
+        // Disable copy
+        CachedMemberID(const CachedMemberID&) = delete;
+        CachedMemberID& operator=(const CachedMemberID&) = delete;
+
+    private:
+        const char* className_;
+        const char* name_;
+        const char* signature_;
+        bool isStatic_;
+        std::atomic<Id> id_{nullptr};
+        std::atomic<jweak> class_{nullptr};
+        std::atomic<uint64_t> generation_{0};
+        std::mutex publishMutex_;
+        std::vector<WeakRef<jclass>> classes_;
+    };
+
+    using CachedMethodID = CachedMemberID<jmethodID>;
+    using CachedFieldID = CachedMemberID<jfieldID>;
+
+    namespace detail {
+        inline jclass ResolveClass(JNIEnv* env, const char* className) {
+            return ClassIdCache::Instance().GetClass(env, className).release();
+        }
+    } // namespace detail
+
+    // Primitive array traits
+    template <typename T> struct JNIArrayTraits;
+
+    // jboolean[]
+    template <> struct JNIArrayTraits<jboolean> {
+        using ArrayType = jbooleanArray;
+        static constexpr const char* signature = "[Z";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewBooleanArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jboolean* buffer) {
+            env->GetBooleanArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jboolean* buffer) {
+            env->SetBooleanArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jbyte[]
+    template <> struct JNIArrayTraits<jbyte> {
+        using ArrayType = jbyteArray;
+        static constexpr const char* signature = "[B";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewByteArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jbyte* buffer) {
+            env->GetByteArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jbyte* buffer) {
+            env->SetByteArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jchar[]
+    template <> struct JNIArrayTraits<jchar> {
+        using ArrayType = jcharArray;
+        static constexpr const char* signature = "[C";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewCharArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jchar* buffer) {
+            env->GetCharArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jchar* buffer) {
+            env->SetCharArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jshort[]
+    template <> struct JNIArrayTraits<jshort> {
+        using ArrayType = jshortArray;
+        static constexpr const char* signature = "[S";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewShortArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jshort* buffer) {
+            env->GetShortArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jshort* buffer) {
+            env->SetShortArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jint[]
+    template <> struct JNIArrayTraits<jint> {
+        using ArrayType = jintArray;
+        static constexpr const char* signature = "[I";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewIntArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jint* buffer) {
+            env->GetIntArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jint* buffer) {
+            env->SetIntArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jlong[]
+    template <> struct JNIArrayTraits<jlong> {
+        using ArrayType = jlongArray;
+        static constexpr const char* signature = "[J";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewLongArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jlong* buffer) {
+            env->GetLongArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jlong* buffer) {
+            env->SetLongArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jfloat[]
+    template <> struct JNIArrayTraits<jfloat> {
+        using ArrayType = jfloatArray;
+        static constexpr const char* signature = "[F";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewFloatArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jfloat* buffer) {
+            env->GetFloatArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jfloat* buffer) {
+            env->SetFloatArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    // jdouble[]
+    template <> struct JNIArrayTraits<jdouble> {
+        using ArrayType = jdoubleArray;
+        static constexpr const char* signature = "[D";
+
+        static ArrayType NewArray(JNIEnv* env, jsize length) {
+            ArrayType result = env->NewDoubleArray(length);
+            JNI_CHECK_EXCEPTION(env);
+            return result;
+        }
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, jdouble* buffer) {
+            env->GetDoubleArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, const jdouble* buffer) {
+            env->SetDoubleArrayRegion(array, start, length, buffer);
+            JNI_CHECK_EXCEPTION(env);
+        }
+    };
+
+    namespace detail {
+        inline std::vector<size_t> RowMajorStrides(const std::vector<jsize>& shape) {
+            std::vector<size_t> strides(shape.size(), 1);
+            for (size_t dim = shape.size(); dim-- > 1;) {
+                strides[dim - 1] = strides[dim] * static_cast<size_t>(shape[dim]);
+            }
+            return strides;
+        }
+    } // namespace detail
+
+    // Contiguous row-major copy of a (possibly jagged) multidimensional Java array
+    template <typename T>
+    struct FlatArray {
+        std::vector<T> data;
+        std::vector<jsize> shape;    // Bounding extent of every dimension
+        std::vector<size_t> strides; // Element strides of every dimension
+        bool jagged = false;         // Some rows were shorter than shape and are padded with T{}
+
+        size_t rank() const { return shape.size(); }
+
+        size_t offset(std::initializer_list<jsize> index) const {
+            size_t result = 0;
+            size_t dim = 0;
+            for (jsize i : index) result += static_cast<size_t>(i) * strides[dim++];
+            return result;
+        }
+
+        T& at(std::initializer_list<jsize> index) { return data[offset(index)]; }
+        const T& at(std::initializer_list<jsize> index) const { return data[offset(index)]; }
+    };
+
+    namespace detail {
+        // Guess a rectangular shape by descending along the first element of every level
+        inline void ProbeShape(JNIEnv* env, jarray array, std::vector<jsize>& shape) {
+            jarray current = array;
+            for (size_t dim = 0; dim < shape.size(); ++dim) {
+                shape[dim] = env->GetArrayLength(current);
+                if (dim + 1 == shape.size() || shape[dim] == 0) break;
+
+                jarray next = static_cast<jarray>(env->GetObjectArrayElement(static_cast<jobjectArray>(current), 0));
+                JNI_CHECK_EXCEPTION(env);
+                if (current != array) env->DeleteLocalRef(current);
+                current = next;
+                if (!current) break;
+            }
+            if (current && current != array) env->DeleteLocalRef(current);
+        }
+
+        // Walk every level and record the largest extent seen per dimension
+        inline void MeasureShape(JNIEnv* env, jarray array, size_t dim, std::vector<jsize>& shape) {
+            jsize length = env->GetArrayLength(array);
+            shape[dim] = std::max(shape[dim], length);
+            if (dim + 1 == shape.size()) return;
+
+            for (jsize i = 0; i < length; ++i) {
+                jarray child = static_cast<jarray>(env->GetObjectArrayElement(static_cast<jobjectArray>(array), i));
+                JNI_CHECK_EXCEPTION(env);
+                if (!child) continue;
+
+                MeasureShape(env, child, dim + 1, shape);
+                env->DeleteLocalRef(child);
+            }
+        }
+
+        // Copy leaf rows straight into place, returns false if a row exceeds the shape
+        template <typename T>
+        bool CopyRows(JNIEnv* env, jarray array, size_t dim, size_t base, FlatArray<T>& out) {
+            jsize length = env->GetArrayLength(array);
+            if (length > out.shape[dim]) return false;
+            if (length < out.shape[dim]) out.jagged = true;
+
+            if (dim + 1 == out.shape.size()) {
+                using ArrayType = typename JNIArrayTraits<T>::ArrayType;
+                JNIArrayTraits<T>::GetRegion(env, static_cast<ArrayType>(array), 0, length, out.data.data() + base);
+                return true;
+            }
+
+            for (jsize i = 0; i < length; ++i) {
+                jarray child = static_cast<jarray>(env->GetObjectArrayElement(static_cast<jobjectArray>(array), i));
+                JNI_CHECK_EXCEPTION(env);
+                if (!child) {
+                    out.jagged = true;
+                    continue;
+                }
+
+                bool fits = CopyRows(env, child, dim + 1, base + static_cast<size_t>(i) * out.strides[dim], out);
+                env->DeleteLocalRef(child);
+                if (!fits) return false;
+            }
+            return true;
+        }
+
+        template <typename T>
+        jarray BuildRows(JNIEnv* env, const T* data, const std::vector<jsize>& shape,
+                         const std::vector<size_t>& strides, const std::vector<jclass>& classes, size_t dim) {
+            if (dim + 1 == shape.size()) {
+                auto row = JNIArrayTraits<T>::NewArray(env, shape[dim]);
+                JNIArrayTraits<T>::SetRegion(env, row, 0, shape[dim], data);
+                return row;
+            }
+
+            jobjectArray level = env->NewObjectArray(shape[dim], classes[dim], nullptr);
+            JNI_CHECK_EXCEPTION(env);
+
+            for (jsize i = 0; i < shape[dim]; ++i) {
+                jarray child = BuildRows(env, data + static_cast<size_t>(i) * strides[dim], shape, strides, classes, dim + 1);
+                env->SetObjectArrayElement(level, i, child);
+                env->DeleteLocalRef(child);
+                JNI_CHECK_EXCEPTION(env);
+            }
+            return level;
+        }
+    } // namespace detail
+
+    // Flatten a rank-N primitive array (e.g. float[][] with rank 2) into one contiguous buffer.
+    // At most rank + 1 local references are alive at any time.
+    template <typename T>
+    FlatArray<T> FlattenArray(JNIEnv* env, jarray array, size_t rank) {
+        FlatArray<T> result;
+        result.shape.assign(rank, 0);
+        result.strides = detail::RowMajorStrides(result.shape);
+        if (!array || rank == 0) return result;
+
+        LocalFrame frame(env, static_cast<jint>(rank) + 1);
+
+        // Rectangular arrays are copied in a single walk
+        detail::ProbeShape(env, array, result.shape);
+        result.strides = detail::RowMajorStrides(result.shape);
+        result.data.assign(result.strides[0] * static_cast<size_t>(result.shape[0]), T{});
+        if (detail::CopyRows(env, array, 0, 0, result)) return result;
+
+        // Jagged rows exceeded the probed shape, measure the bounding box and copy again
+        std::fill(result.shape.begin(), result.shape.end(), 0);
+        detail::MeasureShape(env, array, 0, result.shape);
+        result.strides = detail::RowMajorStrides(result.shape);
+        result.data.assign(result.strides[0] * static_cast<size_t>(result.shape[0]), T{});
+        result.jagged = false;
+        detail::CopyRows(env, array, 0, 0, result);
+        return result;
+    }
+
+    // Build a rectangular rank-N Java array from a contiguous row-major buffer
+    template <typename T>
+    jarray UnflattenArray(JNIEnv* env, const T* data, const std::vector<jsize>& shape) {
+        if (shape.empty()) throw JNIException("UnflattenArray requires at least one dimension");
+
+        std::vector<size_t> strides = detail::RowMajorStrides(shape);
+        LocalFrame frame(env, static_cast<jint>(shape.size()) * 2 + 1);
+
+        // Element class of every object level, innermost first: "[F", "[[F", ...
+        std::vector<jclass> classes(shape.size());
+        std::string className = JNIArrayTraits<T>::signature;
+        for (size_t dim = shape.size() - 1; dim-- > 0;) {
+            classes[dim] = FindClass(env, className.c_str());
+            className.insert(0, 1, '[');
+        }
+
+        jarray result = detail::BuildRows(env, data, shape, strides, classes, 0);
+        return frame.pop(result);
+    }
+
+    template <typename T>
+    jarray UnflattenArray(JNIEnv* env, const FlatArray<T>& array) {
+        return UnflattenArray(env, array.data.data(), array.shape);
+    }
+
+    // Maps a JNI array type back to its element type
+    template <typename ArrayType> struct JNIArrayElement;
+    template <> struct JNIArrayElement<jbooleanArray> { using type = jboolean; };
+    template <> struct JNIArrayElement<jbyteArray> { using type = jbyte; };
+    template <> struct JNIArrayElement<jcharArray> { using type = jchar; };
+    template <> struct JNIArrayElement<jshortArray> { using type = jshort; };
+    template <> struct JNIArrayElement<jintArray> { using type = jint; };
+    template <> struct JNIArrayElement<jlongArray> { using type = jlong; };
+    template <> struct JNIArrayElement<jfloatArray> { using type = jfloat; };
+    template <> struct JNIArrayElement<jdoubleArray> { using type = jdouble; };
+
+    // How native code reaches the contents of a primitive array.
+    // Copy works on a region copy and writes it back with one SetArrayRegion call.
+    // Critical pins the array with GetPrimitiveArrayCritical, which blocks the GC until released;
+    // the sorts keep it to the sort itself, but Copy remains the better choice for large arrays.
+    enum class ArrayAccess {
+        Copy,
+        Critical
+    };
+
+    namespace detail {
+        // Run fn(T* elements, jsize length) on the array contents, committing the result once if requested
+        template <typename ArrayType, typename Fn>
+        void WithArrayElements(JNIEnv* env, ArrayType array, ArrayAccess access, bool commit, Fn&& fn) {
+            using T = typename JNIArrayElement<ArrayType>::type;
+
+            jsize length = env->GetArrayLength(array);
+            if (length == 0) return;
+
+            if (access == ArrayAccess::Critical) {
+                void* elements = env->GetPrimitiveArrayCritical(array, nullptr);
+                if (!elements) {
+                    JNI_CHECK_EXCEPTION(env);
+                    throw JNIException("GetPrimitiveArrayCritical failed");
+                }
+
+                try {
+                    fn(static_cast<T*>(elements), length);
+                } catch (...) {
+                    env->ReleasePrimitiveArrayCritical(array, elements, JNI_ABORT);
+                    throw;
+                }
+                env->ReleasePrimitiveArrayCritical(array, elements, commit ? 0 : JNI_ABORT);
+                return;
+            }
+
+            std::vector<T> buffer(static_cast<size_t>(length));
+            JNIArrayTraits<T>::GetRegion(env, array, 0, length, buffer.data());
+            fn(buffer.data(), length);
+            if (commit) JNIArrayTraits<T>::SetRegion(env, array, 0, length, buffer.data());
+        }
+
+        // Unsigned keys whose natural order matches Java's Arrays.sort order:
+        // -0.0 sorts before 0.0 and every NaN sorts after positive infinity.
+        template <typename T> struct SortKey;
+
+        template <> struct SortKey<jint> {
+            using Key = uint32_t;
+            static Key Get(jint value) { return static_cast<Key>(value) ^ 0x80000000u; }
+        };
+
+        template <> struct SortKey<jlong> {
+            using Key = uint64_t;
+            static Key Get(jlong value) { return static_cast<Key>(value) ^ 0x8000000000000000ull; }
+        };
+
+        template <> struct SortKey<jfloat> {
+            using Key = uint32_t;
+            static Key Get(jfloat value) {
+                if (value != value) return ~Key{0};
+                Key bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+            }
+        };
+
+        template <> struct SortKey<jdouble> {
+            using Key = uint64_t;
+            static Key Get(jdouble value) {
+                if (value != value) return ~Key{0};
+                Key bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                return (bits & 0x8000000000000000ull) ? ~bits : bits | 0x8000000000000000ull;
+            }
+        };
+
+        template <typename T>
+        struct JavaLess {
+            bool operator()(T a, T b) const { return SortKey<T>::Get(a) < SortKey<T>::Get(b); }
+        };
+
+        // Below this size a comparison sort beats the radix passes
+        constexpr size_t kRadixSortThreshold = 1 << 12;
+        // Smallest slice worth handing to its own thread
+        constexpr size_t kParallelChunk = 1 << 16;
+
+        inline unsigned SortThreads(size_t length, unsigned threads) {
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+            size_t useful = std::max<size_t>(1, length / kParallelChunk);
+            return static_cast<unsigned>(std::min<size_t>(threads, useful));
+        }
+
+        // Reusable barrier for a fixed set of threads
+        class ThreadBarrier {
+        public:
+            explicit ThreadBarrier(unsigned count) : count_(count) {}
+
+            // Only while no thread is waiting
+            void Reset(unsigned count) { count_ = count; }
+
+            void Wait() {
+                std::unique_lock<std::mutex> lock(mutex_);
+                uint64_t generation = generation_;
+                if (++arrived_ == count_) {
+                    arrived_ = 0;
+                    ++generation_;
+                    lock.unlock();
+                    condition_.notify_all();
+                    return;
+                }
+                condition_.wait(lock, [this, generation] { return generation_ != generation; });
+            }
+
+        private:
+            std::mutex mutex_;
+            std::condition_variable condition_;
+            unsigned count_;
+            unsigned arrived_ = 0;
+            uint64_t generation_ = 0;
+        };
+
+        // Stable LSD radix sort, one byte per pass, with per-thread histograms and scatter.
+        // Scratch space and threads are set up by the constructor, before the caller pins the array, so a
+        // Critical section covers the sort alone. Threads that fail to start are left out of the barrier.
+        template <typename T>
+        class RadixSorter {
+        public:
+            RadixSorter(size_t length, unsigned threads)
+                    : length_(length), scratch_(length), counts_(SortThreads(length, threads)) {
+                workers_.reserve(counts_.size() - 1);
+                try {
+                    for (unsigned t = 1; t < counts_.size(); ++t) workers_.emplace_back([this, t] { Work(t); });
+                } catch (...) {
+                    // Sort with the threads that did start
+                }
+                threads_ = static_cast<unsigned>(workers_.size()) + 1;
+                barrier_.Reset(threads_);
+            }
+
+            ~RadixSorter() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stopping_ = true;
+                }
+                start_.notify_all();
+                for (std::thread& worker : workers_) worker.join();
+            }
+
+            // Disable copy
+            RadixSorter(const RadixSorter&) = delete;
+            RadixSorter& operator=(const RadixSorter&) = delete;
+
+            // Sort length elements at data, once per sorter
+            void Sort(T* data) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    data_ = data;
+                }
+                start_.notify_all();
+                Run(0);
+                if (sorted_ != data_) std::copy(sorted_, sorted_ + length_, data_);
+            }
+
+        private:
+            using Key = typename SortKey<T>::Key;
+
+            size_t ChunkBegin(unsigned t) const { return length_ * t / threads_; }
+
+            void Work(unsigned t) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    start_.wait(lock, [this] { return data_ || stopping_; });
+                    if (!data_) return;
+                }
+                Run(t);
+            }
+
+            // The threads meet at the barrier between the phases of each pass
+            void Run(unsigned t) {
+                T* src = data_;
+                T* dst = scratch_.data();
+
+                for (unsigned shift = 0; shift < sizeof(Key) * 8; shift += 8) {
+                    counts_[t].fill(0);
+                    for (size_t i = ChunkBegin(t), end = ChunkBegin(t + 1); i < end; ++i) {
+                        ++counts_[t][(SortKey<T>::Get(src[i]) >> shift) & 0xff];
+                    }
+                    barrier_.Wait();
+
+                    if (t == 0) {
+                        // Skip the pass if every key shares this digit
+                        skipPass_ = false;
+                        for (size_t digit = 0; digit < 256 && !skipPass_; ++digit) {
+                            size_t total = 0;
+                            for (unsigned u = 0; u < threads_; ++u) total += counts_[u][digit];
+                            skipPass_ = total == length_;
+                        }
+
+                        // Exclusive prefix over (digit, thread) keeps the scatter stable
+                        size_t offset = 0;
+                        for (size_t digit = 0; digit < 256 && !skipPass_; ++digit) {
+                            for (unsigned u = 0; u < threads_; ++u) {
+                                size_t count = counts_[u][digit];
+                                counts_[u][digit] = offset;
+                                offset += count;
+                            }
+                        }
+                    }
+                    barrier_.Wait();
+                    if (skipPass_) continue;
+
+                    for (size_t i = ChunkBegin(t), end = ChunkBegin(t + 1); i < end; ++i) {
+                        dst[counts_[t][(SortKey<T>::Get(src[i]) >> shift) & 0xff]++] = src[i];
+                    }
+                    barrier_.Wait();
+                    std::swap(src, dst);
+                }
+
+                if (t == 0) sorted_ = src;
+            }
+
+            size_t length_;
+            std::vector<T> scratch_;
+            std::vector<std::array<size_t, 256>> counts_;
+            std::vector<std::thread> workers_;
+            unsigned threads_ = 1;
+            ThreadBarrier barrier_{1};
+            bool skipPass_ = false;
+            T* data_ = nullptr;
+            T* sorted_ = nullptr;
+
+            std::mutex mutex_;
+            std::condition_variable start_;
+            bool stopping_ = false;
+        };
+
+        // Small arrays go to smallSort(first, last), large ones to a RadixSorter prepared before the array is reached
+        template <typename ArrayType, typename SmallSort>
+        void SortArrayElements(JNIEnv* env, ArrayType array, ArrayAccess access, unsigned threads, SmallSort smallSort) {
+            using T = typename JNIArrayElement<ArrayType>::type;
+
+            size_t count = static_cast<size_t>(env->GetArrayLength(array));
+            if (count < kRadixSortThreshold) {
+                WithArrayElements(env, array, access, true, [&smallSort](T* data, jsize length) { smallSort(data, data + length); });
+                return;
+            }
+
+            RadixSorter<T> sorter(count, threads);
+            WithArrayElements(env, array, access, true, [&sorter](T* data, jsize) { sorter.Sort(data); });
+        }
+
+        template <typename T>
+        jint BinarySearch(const T* data, jsize length, T key) {
+            auto target = SortKey<T>::Get(key);
+            jsize low = 0;
+            jsize high = length - 1;
+            while (low <= high) {
+                jsize mid = low + (high - low) / 2;
+                auto value = SortKey<T>::Get(data[mid]);
+                if (value < target) low = mid + 1;
+                else if (value > target) high = mid - 1;
+                else return mid;
+            }
+            return -(low + 1);
+        }
+    } // namespace detail
+
+    // Sort an int[], long[], float[] or double[] in place using Java's ordering.
+    // threads = 0 uses every hardware thread for large arrays.
+    template <typename ArrayType>
+    void SortArray(JNIEnv* env, ArrayType array, ArrayAccess access = ArrayAccess::Copy, unsigned threads = 0) {
+        using T = typename JNIArrayElement<ArrayType>::type;
+        detail::SortArrayElements(env, array, access, threads, [](T* first, T* last) {
+            std::sort(first, last, detail::JavaLess<T>());
+        });
+    }
+
+    // Like SortArray, but equal keys (e.g. NaNs with different payloads) keep their relative order
+    template <typename ArrayType>
+    void StableSortArray(JNIEnv* env, ArrayType array, ArrayAccess access = ArrayAccess::Copy, unsigned threads = 0) {
+        using T = typename JNIArrayElement<ArrayType>::type;
+        detail::SortArrayElements(env, array, access, threads, [](T* first, T* last) {
+            std::stable_sort(first, last, detail::JavaLess<T>());
+        });
+    }
+
+    // Partially sort the array so that index nth holds the element a full sort would put there
+    template <typename ArrayType>
+    void NthElementArray(JNIEnv* env, ArrayType array, jsize nth, ArrayAccess access = ArrayAccess::Copy) {
+        using T = typename JNIArrayElement<ArrayType>::type;
+        // Checked up front, an empty array never reaches the callback
+        jsize arrayLength = env->GetArrayLength(array);
+        if (nth < 0 || nth >= arrayLength) throw JNIException("NthElementArray index out of range");
+
+        detail::WithArrayElements(env, array, access, true, [nth](T* data, jsize length) {
+            std::nth_element(data, data + nth, data + length, detail::JavaLess<T>());
+        });
+    }
+
+    // Search a sorted array, same contract as java.util.Arrays.binarySearch
+    template <typename ArrayType>
+    jint BinarySearchArray(JNIEnv* env, ArrayType array, typename JNIArrayElement<ArrayType>::type key,
+                           ArrayAccess access = ArrayAccess::Critical) {
+        using T = typename JNIArrayElement<ArrayType>::type;
+        jint result = -1;
+        detail::WithArrayElements(env, array, access, false, [&result, key](T* data, jsize length) {
+            result = detail::BinarySearch(data, length, key);
+        });
+        return result;
+    }
+
+    inline void* GetDirectBufferAddress(JNIEnv* env, jobject buffer) {
+        void* address = env->GetDirectBufferAddress(buffer);
+        JNI_CHECK_EXCEPTION(env);
+        if (!address) throw JNIException("Buffer is not a direct java.nio.Buffer");
+        return address;
+    }
+
+    inline jlong GetDirectBufferCapacity(JNIEnv* env, jobject buffer) {
+        jlong capacity = env->GetDirectBufferCapacity(buffer);
+        JNI_CHECK_EXCEPTION(env);
+        if (capacity < 0) throw JNIException("Buffer is not a direct java.nio.Buffer");
+        return capacity;
+    }
+
+    // RAII wrapper for a direct java.nio.ByteBuffer.
+    // Address and capacity are queried once and cached for the lifetime of the wrapper.
+    class DirectBuffer {
+    public:
+        DirectBuffer() = default;
+
+        // Wrap an existing direct buffer, the reference is not owned
+        DirectBuffer(JNIEnv* env, jobject buffer)
+                : buffer_(buffer),
+                  address_(static_cast<std::byte*>(jni::GetDirectBufferAddress(env, buffer))),
+                  capacity_(static_cast<size_t>(jni::GetDirectBufferCapacity(env, buffer))) {}
+
+        // Expose native memory as a new direct buffer, owning the local reference
+        static DirectBuffer Create(JNIEnv* env, void* address, size_t capacity) {
+            jobject buffer = env->NewDirectByteBuffer(address, static_cast<jlong>(capacity));
+            JNI_CHECK_EXCEPTION(env);
+            if (!buffer) throw JNIException("NewDirectByteBuffer failed");
+
+            DirectBuffer result;
+            result.env_ = env;
+            result.buffer_ = buffer;
+            result.address_ = static_cast<std::byte*>(address);
+            result.capacity_ = capacity;
+            return result;
+        }
+
+        ~DirectBuffer() { reset(); }
+
+        DirectBuffer(DirectBuffer&& other) noexcept
+                : env_(other.env_), buffer_(other.buffer_), address_(other.address_), capacity_(other.capacity_) {
+            other.env_ = nullptr;
+            other.buffer_ = nullptr;
+            other.address_ = nullptr;
+            other.capacity_ = 0;
+        }
+
+        DirectBuffer& operator=(DirectBuffer&& other) noexcept {
+            if (this != &other) {
+                reset();
+                std::swap(env_, other.env_);
+                std::swap(buffer_, other.buffer_);
+                std::swap(address_, other.address_);
+                std::swap(capacity_, other.capacity_);
+            }
+            return *this;
+        }
+
+        // Disable copy
+        DirectBuffer(const DirectBuffer&) = delete;
+        DirectBuffer& operator=(const DirectBuffer&) = delete;
+
+        jobject get() const { return buffer_; }
+
+        // Give up ownership of the local reference, the cached view stays valid
+        jobject release() {
+            jobject temp = buffer_;
+            env_ = nullptr;
+            return temp;
+        }
+
+        void reset() {
+            if (env_ && buffer_) env_->DeleteLocalRef(buffer_);
+            env_ = nullptr;
+            buffer_ = nullptr;
+            address_ = nullptr;
+            capacity_ = 0;
+        }
+
+        std::byte* data() const { return address_; }
+        size_t size() const { return capacity_; }
+        bool empty() const { return capacity_ == 0; }
+        explicit operator bool() const { return buffer_ != nullptr; }
+
+        template <typename T>
+        T* as() const { return reinterpret_cast<T*>(address_); }
+
+#if JNI_HELPER_HAS_SPAN
+        std::span<std::byte> span() const { return {address_, capacity_}; }
+#endif
+
+    private:
+        JNIEnv* env_ = nullptr; // Set only when the local reference is owned
+        jobject buffer_ = nullptr;
+        std::byte* address_ = nullptr;
+        size_t capacity_ = 0;
+    };
+
+    // Caches address and capacity of long-lived direct buffers behind a global reference.
+    // Keep the returned Entry pointer on the hot path, reading it is a plain pointer load.
+    class DirectBufferRegistry {
+    public:
+        struct Entry {
+            jobject buffer; // Global reference
+            std::byte* address;
+            size_t capacity;
+
+#if JNI_HELPER_HAS_SPAN
+            std::span<std::byte> span() const { return {address, capacity}; }
+#endif
+        };
+
+        static DirectBufferRegistry& Instance() {
+            static DirectBufferRegistry registry;
+            return registry;
+        }
+
+        // Promote the buffer to a global reference and cache its view
+        const Entry* Register(JNIEnv* env, jobject buffer) {
+            auto entry = std::make_unique<Entry>();
+            entry->address = static_cast<std::byte*>(jni::GetDirectBufferAddress(env, buffer));
+            entry->capacity = static_cast<size_t>(jni::GetDirectBufferCapacity(env, buffer));
+            entry->buffer = env->NewGlobalRef(buffer);
+            if (!entry->buffer) throw JNIException("NewGlobalRef failed");
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            const Entry* result = entry.get();
+            entries_.emplace(entry->buffer, std::move(entry));
+            return result;
+        }
+
+        // Look up a buffer by the global reference returned in Entry::buffer
+        const Entry* Find(jobject globalBuffer) const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(globalBuffer);
+            return it != entries_.end() ? it->second.get() : nullptr;
+        }
+
+        void Unregister(JNIEnv* env, const Entry* entry) {
+            if (!entry) return;
+
+            std::unique_ptr<Entry> removed;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(entry->buffer);
+                if (it == entries_.end()) return;
+                removed = std::move(it->second);
+                entries_.erase(it);
+            }
+            env->DeleteGlobalRef(removed->buffer);
+        }
+
+        // Release every global reference, must be called before the VM goes away
+        void Clear(JNIEnv* env) {
+            std::unordered_map<jobject, std::unique_ptr<Entry>> entries;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                entries.swap(entries_);
+            }
+            for (auto& [buffer, entry] : entries) env->DeleteGlobalRef(buffer);
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entries_.size();
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::unordered_map<jobject, std::unique_ptr<Entry>> entries_;
+    };
+
+    namespace detail {
+        // Lock-free stack of uint32 indices, the tag in the high half guards against ABA.
+        // links(index) returns the std::atomic<uint32_t> that stores the next index below it.
+        class IndexFreeList {
+        public:
+            static constexpr uint32_t kNone = 0xffffffffu;
+
+            template <typename Links>
+            void push(Links&& links, uint32_t index) {
+                uint64_t old = head_.load(std::memory_order_relaxed);
+                uint64_t desired;
+                do {
+                    links(index).store(static_cast<uint32_t>(old), std::memory_order_relaxed);
+                    desired = ((old >> 32) + 1) << 32 | index;
+                } while (!head_.compare_exchange_weak(old, desired, std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            template <typename Links>
+            uint32_t pop(Links&& links) {
+                uint64_t old = head_.load(std::memory_order_acquire);
+                uint64_t desired;
+                do {
+                    uint32_t index = static_cast<uint32_t>(old);
+                    if (index == kNone) return kNone;
+                    desired = ((old >> 32) + 1) << 32 | links(index).load(std::memory_order_relaxed);
+                } while (!head_.compare_exchange_weak(old, desired, std::memory_order_acquire, std::memory_order_acquire));
+                return static_cast<uint32_t>(old);
+            }
+
+        private:
+            std::atomic<uint64_t> head_{kNone};
+        };
+    } // namespace detail
+
+    // Fixed pool of direct ByteBuffer slices carved from one native arena.
+    // Every slice is wrapped in a ByteBuffer once at construction and recycled afterwards,
+    // so handing a message to Java costs no copy and no Java allocation.
+    // Recycled buffers keep the previous user's position and limit: either take them with
+    // Acquire(env, length), which resets position to 0 and limit to length, or pass slice->length
+    // to Java along with the id and read with absolute gets (or buffer.clear().limit(length)).
+    // Java hands a slice back through a native method that calls Release(id).
+    class DirectBufferPool {
+    public:
+        struct SizeClass {
+            size_t sliceSize;
+            size_t sliceCount;
+        };
+
+        struct Slice {
+            jint id;
+            jobject buffer; // Global reference, valid for the lifetime of the pool
+            std::byte* data;
+            size_t capacity;
+            size_t length;  // Message length requested by the last Acquire
+
+#if JNI_HELPER_HAS_SPAN
+            std::span<std::byte> span() const { return {data, capacity}; }
+#endif
+        };
+
+        struct Stats {
+            size_t slices;
+            size_t inUse;
+            size_t highWater;
+            uint64_t acquired;
+            uint64_t released;
+            uint64_t exhausted; // Acquire calls that found no free slice
+        };
+
+        static constexpr size_t kSliceAlignment = 64;
+
+        DirectBufferPool(JNIEnv* env, std::vector<SizeClass> sizeClasses) {
+            detail::RememberVM(env);
+
+            // Smallest class first so Acquire picks the tightest fit
+            std::sort(sizeClasses.begin(), sizeClasses.end(),
+                      [](const SizeClass& a, const SizeClass& b) { return a.sliceSize < b.sliceSize; });
+
+            size_t total = 0;
+            size_t sliceCount = 0;
+            for (SizeClass& sizeClass : sizeClasses) {
+                sizeClass.sliceSize = (sizeClass.sliceSize + kSliceAlignment - 1) & ~(kSliceAlignment - 1);
+                total += sizeClass.sliceSize * sizeClass.sliceCount;
+                sliceCount += sizeClass.sliceCount;
+            }
+            if (sliceCount == 0 || sliceCount > 0xfffffffeu) throw JNIException("Invalid DirectBufferPool size");
+
+            arena_ = static_cast<std::byte*>(::operator new(total, std::align_val_t(kSliceAlignment)));
+            slices_.reserve(sliceCount);
+            next_ = std::make_unique<std::atomic<uint32_t>[]>(sliceCount);
+            inUse_ = std::make_unique<std::atomic<bool>[]>(sliceCount);
+            classes_ = std::make_unique<SizeClassList[]>(sizeClasses.size());
+            classCount_ = sizeClasses.size();
+
+            try {
+                std::byte* cursor = arena_;
+                for (size_t c = 0; c < sizeClasses.size(); ++c) {
+                    classes_[c].sliceSize = sizeClasses[c].sliceSize;
+                    for (size_t i = 0; i < sizeClasses[c].sliceCount; ++i) {
+                        ScopedLocalRef<jobject> local(env, env->NewDirectByteBuffer(cursor, static_cast<jlong>(sizeClasses[c].sliceSize)));
+                        JNI_CHECK_EXCEPTION(env);
+                        if (!local.get()) throw JNIException("NewDirectByteBuffer failed");
+
+                        jobject global = env->NewGlobalRef(local.get());
+                        if (!global) throw JNIException("NewGlobalRef failed");
+
+                        jint id = static_cast<jint>(slices_.size());
+                        slices_.push_back({id, global, cursor, sizeClasses[c].sliceSize, 0});
+                        inUse_[id].store(false, std::memory_order_relaxed);
+                        classes_[c].free.push(Links{this}, static_cast<uint32_t>(id));
+                        cursor += sizeClasses[c].sliceSize;
+                    }
+                }
+            } catch (...) {
+                for (const Slice& slice : slices_) env->DeleteGlobalRef(slice.buffer);
+                ::operator delete(arena_, std::align_val_t(kSliceAlignment));
+                throw;
+            }
+        }
+
+        // Unattached threads are attached temporarily to drop the global references. Only if that
+        // is impossible (no VM) is the arena leaked rather than freed under live ByteBuffers.
+        ~DirectBufferPool() {
+            bool released = false;
+            detail::WithAnyThreadEnv([this, &released](JNIEnv* env) {
+                for (const Slice& slice : slices_) env->DeleteGlobalRef(slice.buffer);
+                released = true;
+            });
+            if (released) ::operator delete(arena_, std::align_val_t(kSliceAlignment));
+        }
+
+        // Disable copy
+        DirectBufferPool(const DirectBufferPool&) = delete;
+        DirectBufferPool& operator=(const DirectBufferPool&) = delete;
+
+        // Take a free slice of at least minSize bytes, nullptr when the pool is exhausted.
+        // The buffer's position and limit are left as the previous user set them, see the class comment.
+        const Slice* Acquire(size_t minSize) {
+            for (size_t c = 0; c < classCount_; ++c) {
+                if (classes_[c].sliceSize < minSize) continue;
+
+                uint32_t id = classes_[c].free.pop(Links{this});
+                if (id == detail::IndexFreeList::kNone) continue;
+
+                slices_[id].length = minSize;
+                inUse_[id].store(true, std::memory_order_relaxed);
+                acquired_.fetch_add(1, std::memory_order_relaxed);
+                size_t inUse = inUseCount_.fetch_add(1, std::memory_order_relaxed) + 1;
+                size_t highWater = highWater_.load(std::memory_order_relaxed);
+                while (inUse > highWater && !highWater_.compare_exchange_weak(highWater, inUse, std::memory_order_relaxed)) {}
+                return &slices_[id];
+            }
+            exhausted_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        // Same as Acquire(length), and the buffer is reset to position 0 and limit length for Java
+        const Slice* Acquire(JNIEnv* env, size_t length) {
+            static CachedMethodID clear("java/nio/Buffer", "clear", "()Ljava/nio/Buffer;");
+            static CachedMethodID limit("java/nio/Buffer", "limit", "(I)Ljava/nio/Buffer;");
+
+            const Slice* slice = Acquire(length);
+            if (!slice) return nullptr;
+
+            try {
+                jmethodID clearId = clear.get(env);
+                jmethodID limitId = limit.get(env);
+                DeleteLocalRef(env, env->CallObjectMethod(slice->buffer, clearId));
+                JNI_CHECK_EXCEPTION(env);
+                DeleteLocalRef(env, env->CallObjectMethod(slice->buffer, limitId, static_cast<jint>(length)));
+                JNI_CHECK_EXCEPTION(env);
+            } catch (...) {
+                Release(slice);
+                throw;
+            }
+            return slice;
+        }
+
+        // Return a slice by id, false if the id is invalid or the slice is not in use
+        bool Release(jint id) {
+            if (id < 0 || static_cast<size_t>(id) >= slices_.size()) return false;
+            if (!inUse_[id].exchange(false, std::memory_order_relaxed)) return false;
+
+            classes_[ClassOf(id)].free.push(Links{this}, static_cast<uint32_t>(id));
+            released_.fetch_add(1, std::memory_order_relaxed);
+            inUseCount_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool Release(const Slice* slice) { return slice && Release(slice->id); }
+
+        const Slice& slice(jint id) const { return slices_.at(static_cast<size_t>(id)); }
+
+        Stats stats() const {
+            return {
+                    slices_.size(),
+                    inUseCount_.load(std::memory_order_relaxed),
+                    highWater_.load(std::memory_order_relaxed),
+                    acquired_.load(std::memory_order_relaxed),
+                    released_.load(std::memory_order_relaxed),
+                    exhausted_.load(std::memory_order_relaxed)
+            };
+        }
+
+    private:
+        struct SizeClassList {
+            size_t sliceSize = 0;
+            detail::IndexFreeList free;
+        };
+
+        // Free list links of the slices
+        struct Links {
+            DirectBufferPool* pool;
+            std::atomic<uint32_t>& operator()(uint32_t id) const { return pool->next_[id]; }
+        };
+
+        size_t ClassOf(jint id) const {
+            size_t capacity = slices_[id].capacity;
+            size_t c = 0;
+            while (classes_[c].sliceSize != capacity) ++c;
+            return c;
+        }
+
+        std::byte* arena_ = nullptr;
+        std::vector<Slice> slices_;
+        std::unique_ptr<std::atomic<uint32_t>[]> next_;
+        std::unique_ptr<std::atomic<bool>[]> inUse_;
+        std::unique_ptr<SizeClassList[]> classes_;
+        size_t classCount_ = 0;
+
+        std::atomic<size_t> inUseCount_{0};
+        std::atomic<size_t> highWater_{0};
+        std::atomic<uint64_t> acquired_{0};
+        std::atomic<uint64_t> released_{0};
+        std::atomic<uint64_t> exhausted_{0};
+    };
+
+    // Memory-mapped file shared between native code and Java through direct ByteBuffer views.
+    // The mapping is unmapped when the MappedFile is destroyed or close() is called,
+    // so Java must drop its views first. Java can own it through handle()/FromHandle()/CloseHandle().
+    class MappedFile {
+    public:
+        enum class Mode {
+            ReadOnly,
+            ReadWrite // MAP_SHARED, writes reach the file
+        };
+
+        enum class Advice {
+            Normal = MADV_NORMAL,
+            Sequential = MADV_SEQUENTIAL,
+            Random = MADV_RANDOM,
+            WillNeed = MADV_WILLNEED,
+            DontNeed = MADV_DONTNEED
+        };
+
+        // A ByteBuffer holds at most Integer.MAX_VALUE bytes, views are cut page-aligned below that
+        static constexpr size_t kMaxViewSize = size_t{1} << 30;
+
+        MappedFile() = default;
+
+        static MappedFile Open(const std::string& path, Mode mode = Mode::ReadOnly, Advice advice = Advice::Normal) {
+            int fd = ::open(path.c_str(), (mode == Mode::ReadOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+            if (fd < 0) throw JNIException(SystemError("open", path).c_str());
+
+            try {
+                MappedFile result = FromFd(fd, mode, advice, path);
+                ::close(fd);
+                return result;
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+        }
+
+        // Map the whole of an open descriptor, the caller keeps owning it
+        static MappedFile FromFd(int fd, Mode mode = Mode::ReadOnly, Advice advice = Advice::Normal,
+                                 const std::string& name = "fd") {
+            struct stat info {};
+            if (::fstat(fd, &info) != 0) throw JNIException(SystemError("fstat", name).c_str());
+
+            MappedFile result;
+            result.mode_ = mode;
+            if (info.st_size > 0) {
+                int protection = mode == Mode::ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+                void* address = ::mmap(nullptr, static_cast<size_t>(info.st_size), protection, MAP_SHARED, fd, 0);
+                if (address == MAP_FAILED) throw JNIException(SystemError("mmap", name).c_str());
+
+                result.data_ = static_cast<std::byte*>(address);
+                result.size_ = static_cast<size_t>(info.st_size);
+            }
+
+            if (advice != Advice::Normal) result.advise(advice);
+            return result;
+        }
+
+        ~MappedFile() { close(); }
+
+        MappedFile(MappedFile&& other) noexcept : data_(other.data_), size_(other.size_), mode_(other.mode_) {
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        MappedFile& operator=(MappedFile&& other) noexcept {
+            if (this != &other) {
+                close();
+                std::swap(data_, other.data_);
+                std::swap(size_, other.size_);
+                mode_ = other.mode_;
+            }
+            return *this;
+        }
+
+        // Disable copy
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        std::byte* data() const { return data_; }
+        size_t size() const { return size_; }
+        Mode mode() const { return mode_; }
+        bool isOpen() const { return data_ != nullptr; }
+
+#if JNI_HELPER_HAS_SPAN
+        std::span<std::byte> span() const { return {data_, size_}; }
+#endif
+
+        // Advise [offset, offset + length), clamped to the mapping; length 0 means up to the end
+        void advise(Advice advice, size_t offset = 0, size_t length = 0) {
+            if (!data_ || offset >= size_) return;
+
+            // madvise needs a page-aligned start
+            size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+            size_t start = offset & ~(page - 1);
+            size_t end = length && length < size_ - offset ? offset + length : size_;
+            ::madvise(data_ + start, end - start, static_cast<int>(advice));
+        }
+
+        // Flush dirty pages of a ReadWrite mapping to the file
+        void sync(bool wait = true) {
+            if (data_ && mode_ == Mode::ReadWrite) ::msync(data_, size_, wait ? MS_SYNC : MS_ASYNC);
+        }
+
+        void close() {
+            if (data_) ::munmap(data_, size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        // A direct ByteBuffer over [offset, offset + length), returned as a local reference.
+        // Views of a ReadOnly mapping are read-only buffers, so Java cannot fault writing to PROT_READ pages.
+        jobject CreateBuffer(JNIEnv* env, size_t offset, size_t length) const {
+            if (offset > size_ || length > size_ - offset) throw JNIException("MappedFile view out of range");
+            if (length > static_cast<size_t>(0x7fffffff)) throw JNIException("MappedFile view exceeds Integer.MAX_VALUE");
+
+            jobject buffer = env->NewDirectByteBuffer(data_ + offset, static_cast<jlong>(length));
+            JNI_CHECK_EXCEPTION(env);
+            if (!buffer) throw JNIException("NewDirectByteBuffer failed");
+            if (mode_ == Mode::ReadWrite) return buffer;
+
+            static CachedMethodID asReadOnlyBuffer("java/nio/ByteBuffer", "asReadOnlyBuffer", "()Ljava/nio/ByteBuffer;");
+            ScopedLocalRef<jobject> writable(env, buffer);
+            jobject readOnly = env->CallObjectMethod(writable.get(), asReadOnlyBuffer.get(env));
+            JNI_CHECK_EXCEPTION(env);
+            if (!readOnly) throw JNIException("asReadOnlyBuffer failed");
+            return readOnly;
+        }
+
+        // Cover the whole mapping with consecutive views of at most viewSize bytes
+        jobjectArray CreateBuffers(JNIEnv* env, size_t viewSize = kMaxViewSize) const {
+            if (viewSize == 0 || viewSize > static_cast<size_t>(0x7fffffff)) throw JNIException("Invalid MappedFile view size");
+
+            size_t count = (size_ + viewSize - 1) / viewSize;
+            jclass bufferClass = FindClass(env, "java/nio/ByteBuffer");
+            ScopedLocalRef<jclass> bufferClassRef(env, bufferClass);
+
+            jobjectArray views = env->NewObjectArray(static_cast<jsize>(count), bufferClass, nullptr);
+            JNI_CHECK_EXCEPTION(env);
+
+            for (size_t i = 0; i < count; ++i) {
+                size_t offset = i * viewSize;
+                ScopedLocalRef<jobject> view(env, CreateBuffer(env, offset, std::min(viewSize, size_ - offset)));
+                env->SetObjectArrayElement(views, static_cast<jsize>(i), view.get());
+                JNI_CHECK_EXCEPTION(env);
+            }
+            return views;
+        }
+
+        // Move the mapping to the heap and return an opaque handle Java can keep in a long field
+        static jlong ToHandle(MappedFile&& file) {
+            return static_cast<jlong>(reinterpret_cast<intptr_t>(new MappedFile(std::move(file))));
+        }
+
+        static MappedFile* FromHandle(jlong handle) {
+            return reinterpret_cast<MappedFile*>(static_cast<intptr_t>(handle));
+        }
+
+        // Unmap and free a handle returned by ToHandle
+        static void CloseHandle(jlong handle) {
+            delete FromHandle(handle);
+        }
+
+    private:
+        static std::string SystemError(const char* call, const std::string& path) {
+            return std::string(call) + "(" + path + ") failed: " + std::strerror(errno);
+        }
+
+        std::byte* data_ = nullptr;
+        size_t size_ = 0;
+        Mode mode_ = Mode::ReadOnly;
+    };
+
+    // Ring buffer of variable-length records living entirely inside a direct ByteBuffer,
+    // so native code and Java exchange records without JNI calls on the data path.
+    //
+    // Layout (native byte order):
+    //   [0]    int64 head     consumer position, written by the consumer only
+    //   [64]   int64 tail     producer claim position
+    //   [128]  int32 parked   1 while the consumer is parked
+    //   [192]  data           capacity bytes, capacity is a power of two
+    // Every record starts 8-byte aligned with an int32 length (payload + 8, written last with
+    // release semantics, 0 means not yet committed) and an int32 type (-1 marks wrap padding).
+    // The consumer zeroes what it consumed before advancing head.
+    //
+    // Ordering, the same on both sides of the boundary: head is read with acquire by producers and stored
+    // with release by the consumer; a record's length is read with acquire by the consumer. A consumer
+    // sets parked (seq_cst) and rechecks before sleeping, a producer fences, then swaps parked to 0 and
+    // wakes it: native consumers through the futex, Java consumers through the SetWakeup upcall.
+    // GenerateRingBufferJava produces the matching Java end.
+    class RingBuffer {
+    public:
+        enum class Mode {
+            SingleProducer,
+            MultiProducer
+        };
+
+        struct Record {
+            jint type;
+            const void* data;
+            size_t length;
+        };
+
+        static constexpr size_t kHeadOffset = 0;
+        static constexpr size_t kTailOffset = 64;
+        static constexpr size_t kParkedOffset = 128;
+        static constexpr size_t kHeaderSize = 192;
+        static constexpr size_t kRecordHeaderSize = 8;
+        static constexpr size_t kRecordAlignment = 8;
+        static constexpr jint kPaddingType = -1;
+
+        // Bytes of storage needed for a ring with the given data capacity
+        static constexpr size_t RequiredSize(size_t capacity) { return kHeaderSize + capacity; }
+
+        // Wrap raw storage, initialize clears the header and data on the creating side
+        RingBuffer(void* storage, size_t size, Mode mode, bool initialize = true)
+                : base_(static_cast<std::byte*>(storage)), mode_(mode) {
+            if (size <= kHeaderSize) throw JNIException("RingBuffer storage too small");
+
+            capacity_ = size_t{1};
+            while (capacity_ * 2 <= size - kHeaderSize) capacity_ *= 2;
+            if (capacity_ < kRecordHeaderSize * 2) throw JNIException("RingBuffer storage too small");
+            // Record lengths and padding are int32
+            if (capacity_ >= (size_t{1} << 32)) throw JNIException("RingBuffer capacity must be below 2^32");
+
+            data_ = base_ + kHeaderSize;
+            if (initialize) std::memset(base_, 0, kHeaderSize + capacity_);
+        }
+
+        RingBuffer(JNIEnv* env, jobject directBuffer, Mode mode, bool initialize = true)
+                : RingBuffer(jni::GetDirectBufferAddress(env, directBuffer),
+                             static_cast<size_t>(jni::GetDirectBufferCapacity(env, directBuffer)), mode, initialize) {}
+
+        size_t capacity() const { return capacity_; }
+
+        // Largest payload a single record can carry
+        size_t maxPayload() const { return capacity_ / 2 - kRecordHeaderSize; }
+
+        // Called after a publish that found the consumer parked, e.g. one upcall to LockSupport.unpark
+        void SetWakeup(std::function<void()> wakeup) { wakeup_ = std::move(wakeup); }
+
+        bool TryPublish(jint type, const void* data, size_t length) {
+            Record record{type, data, length};
+            return PublishBatch(&record, 1);
+        }
+
+        // Claim space for every record at once and commit them in order, all or nothing
+        bool PublishBatch(const Record* records, size_t count) {
+            size_t total = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (records[i].type < 0 || records[i].length > maxPayload()) throw JNIException("Invalid RingBuffer record");
+                total += AlignRecord(kRecordHeaderSize + records[i].length);
+            }
+            if (total == 0) return true;
+            if (total > capacity_ / 2) throw JNIException("RingBuffer batch too large");
+
+            uint64_t position;
+            if (!Claim(total, position)) return false;
+
+            for (size_t i = 0; i < count; ++i) {
+                std::byte* header = data_ + (position & (capacity_ - 1));
+                size_t recordLength = kRecordHeaderSize + records[i].length;
+                std::memcpy(header + 4, &records[i].type, sizeof(jint));
+                if (records[i].length) std::memcpy(header + kRecordHeaderSize, records[i].data, records[i].length);
+                __atomic_store_n(reinterpret_cast<int32_t*>(header), static_cast<int32_t>(recordLength), __ATOMIC_RELEASE);
+                position += AlignRecord(recordLength);
+            }
+
+            WakeConsumer();
+            return true;
+        }
+
+        // Hand up to limit committed records to handler(type, const std::byte* data, size_t length),
+        // then release their space with a single head update. Returns the number of records consumed.
+        // If the handler throws, the records before it are released and the failing one stays at the head.
+        template <typename Handler>
+        size_t Consume(Handler&& handler, size_t limit = SIZE_MAX) {
+            uint64_t head = __atomic_load_n(Head(), __ATOMIC_RELAXED);
+            uint64_t position = head;
+            size_t consumed = 0;
+
+            try {
+                while (consumed < limit) {
+                    std::byte* header = data_ + (position & (capacity_ - 1));
+                    int32_t recordLength = __atomic_load_n(reinterpret_cast<int32_t*>(header), __ATOMIC_ACQUIRE);
+                    if (recordLength == 0) break;
+
+                    jint type;
+                    std::memcpy(&type, header + 4, sizeof(jint));
+                    if (type != kPaddingType) {
+                        handler(type, header + kRecordHeaderSize, static_cast<size_t>(recordLength) - kRecordHeaderSize);
+                        ++consumed;
+                    }
+
+                    // Zeroed only once handled, so everything zeroed is covered by the head store below
+                    size_t aligned = AlignRecord(static_cast<size_t>(recordLength));
+                    std::memset(header, 0, aligned);
+                    position += aligned;
+                }
+            } catch (...) {
+                if (position != head) __atomic_store_n(Head(), position, __ATOMIC_RELEASE);
+                throw;
+            }
+
+            if (position != head) __atomic_store_n(Head(), position, __ATOMIC_RELEASE);
+            return consumed;
+        }
+
+        // Wake a native consumer parked in Wait, for Java producers that found parked set
+        void Wake() { ::syscall(SYS_futex, Parked(), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0); }
+
+        bool empty() const {
+            uint64_t head = __atomic_load_n(Head(), __ATOMIC_ACQUIRE);
+            return __atomic_load_n(reinterpret_cast<int32_t*>(data_ + (head & (capacity_ - 1))), __ATOMIC_ACQUIRE) == 0;
+        }
+
+        // Park a native consumer until a producer publishes or the timeout expires
+        bool Wait(std::chrono::nanoseconds timeout) {
+            __atomic_store_n(Parked(), 1, __ATOMIC_SEQ_CST);
+            if (!empty()) {
+                __atomic_store_n(Parked(), 0, __ATOMIC_RELAXED);
+                return true;
+            }
+
+            timespec remaining{};
+            remaining.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+            remaining.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+            ::syscall(SYS_futex, Parked(), FUTEX_WAIT, 1, &remaining, nullptr, 0);
+
+            __atomic_store_n(Parked(), 0, __ATOMIC_RELAXED);
+            return !empty();
+        }
+
+    private:
+        static size_t AlignRecord(size_t length) { return (length + kRecordAlignment - 1) & ~(kRecordAlignment - 1); }
+
+        uint64_t* Head() const { return reinterpret_cast<uint64_t*>(base_ + kHeadOffset); }
+        uint64_t* Tail() const { return reinterpret_cast<uint64_t*>(base_ + kTailOffset); }
+        int32_t* Parked() const { return reinterpret_cast<int32_t*>(base_ + kParkedOffset); }
+
+        // Reserve total contiguous bytes, inserting a padding record when they would wrap
+        bool Claim(size_t total, uint64_t& position) {
+            uint64_t tail = __atomic_load_n(Tail(), __ATOMIC_RELAXED);
+            while (true) {
+                uint64_t head = __atomic_load_n(Head(), __ATOMIC_ACQUIRE);
+                size_t toEnd = capacity_ - static_cast<size_t>(tail & (capacity_ - 1));
+                size_t padding = total > toEnd ? toEnd : 0;
+                if (tail + padding + total - head > capacity_) return false;
+
+                uint64_t next = tail + padding + total;
+                if (mode_ == Mode::SingleProducer) {
+                    __atomic_store_n(Tail(), next, __ATOMIC_RELAXED);
+                } else if (!__atomic_compare_exchange_n(Tail(), &tail, next, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    continue;
+                }
+
+                if (padding) {
+                    std::byte* header = data_ + (tail & (capacity_ - 1));
+                    std::memcpy(header + 4, &kPaddingType, sizeof(jint));
+                    __atomic_store_n(reinterpret_cast<int32_t*>(header), static_cast<int32_t>(padding), __ATOMIC_RELEASE);
+                }
+                position = tail + padding;
+                return true;
+            }
+        }
+
+        void WakeConsumer() {
+            // Pairs with the seq_cst store in Wait and the parked write of a Java consumer
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(Parked(), __ATOMIC_RELAXED) == 0) return;
+            if (__atomic_exchange_n(Parked(), 0, __ATOMIC_SEQ_CST) == 0) return;
+
+            Wake();
+            if (wakeup_) wakeup_();
+        }
+
+        std::byte* base_;
+        std::byte* data_;
+        size_t capacity_;
+        Mode mode_;
+        std::function<void()> wakeup_;
+    };
+
+    // Java source of the reference Java end of RingBuffer, for a JNI class name such as "com/example/NativeRing".
+    // It follows the layout and ordering documented on RingBuffer through byteBufferViewVarHandle accesses
+    // (Java 9+, Android API 33+), and can act as consumer or as producer.
+    inline std::string GenerateRingBufferJava(const std::string& className) {
+        size_t slash = className.rfind('/');
+        std::string packageName = slash == std::string::npos ? "" : className.substr(0, slash);
+        std::replace(packageName.begin(), packageName.end(), '/', '.');
+        std::string simpleName = slash == std::string::npos ? className : className.substr(slash + 1);
+
+        std::string out;
+        if (!packageName.empty()) out += "package " + packageName + ";\n\n";
+        out += "import java.lang.invoke.MethodHandles;\n";
+        out += "import java.lang.invoke.VarHandle;\n";
+        out += "import java.nio.ByteBuffer;\n";
+        out += "import java.nio.ByteOrder;\n";
+        out += "import java.util.concurrent.locks.LockSupport;\n\n";
+        out += "// Generated by jni::GenerateRingBufferJava, do not edit\n";
+        out += "// Java end of a jni::RingBuffer, either consumer or producer. Needs Java 9+ or Android API 33+\n";
+        out += "// for MethodHandles.byteBufferViewVarHandle.\n";
+        out += "public final class " + simpleName + " {\n";
+        out += "    public interface Handler {\n";
+        out += "        // data is only valid during the call, the payload is [offset, offset + length)\n";
+        out += "        void onRecord(int type, ByteBuffer data, int offset, int length);\n";
+        out += "    }\n\n";
+        out += "    private static final int HEAD = 0;\n";
+        out += "    private static final int TAIL = 64;\n";
+        out += "    private static final int PARKED = 128;\n";
+        out += "    private static final int HEADER_SIZE = 192;\n";
+        out += "    private static final int RECORD_HEADER_SIZE = 8;\n";
+        out += "    private static final int PADDING_TYPE = -1;\n\n";
+        out += "    private static final VarHandle LONGS = MethodHandles.byteBufferViewVarHandle(long[].class, ByteOrder.nativeOrder());\n";
+        out += "    private static final VarHandle INTS = MethodHandles.byteBufferViewVarHandle(int[].class, ByteOrder.nativeOrder());\n\n";
+        out += "    private final ByteBuffer buffer;\n";
+        out += "    private final int capacity;\n";
+        out += "    private final boolean multiProducer;\n";
+        out += "    private final Runnable wakeup;\n\n";
+        out += "    // wakeup is called after a publish that found a native consumer parked, e.g. a native method calling RingBuffer::Wake\n";
+        out += "    public " + simpleName + "(ByteBuffer buffer, boolean multiProducer, Runnable wakeup) {\n";
+        out += "        long size = buffer.capacity() - HEADER_SIZE;\n";
+        out += "        long capacity = 1;\n";
+        out += "        while (capacity * 2 <= size) capacity *= 2;\n";
+        out += "        this.buffer = buffer;\n";
+        out += "        this.capacity = (int) capacity;\n";
+        out += "        this.multiProducer = multiProducer;\n";
+        out += "        this.wakeup = wakeup;\n";
+        out += "    }\n\n";
+        out += "    public int maxPayload() { return capacity / 2 - RECORD_HEADER_SIZE; }\n\n";
+        out += "    public boolean isEmpty() {\n";
+        out += "        long head = (long) LONGS.getAcquire(buffer, HEAD);\n";
+        out += "        return (int) INTS.getAcquire(buffer, offset(head)) == 0;\n";
+        out += "    }\n\n";
+        out += "    // Consumer: hand up to limit committed records to handler, then release their space with one head store\n";
+        out += "    public int consume(Handler handler, int limit) {\n";
+        out += "        long head = (long) LONGS.getOpaque(buffer, HEAD);\n";
+        out += "        long position = head;\n";
+        out += "        int consumed = 0;\n";
+        out += "        try {\n";
+        out += "            while (consumed < limit) {\n";
+        out += "                int at = offset(position);\n";
+        out += "                int length = (int) INTS.getAcquire(buffer, at);\n";
+        out += "                if (length == 0) break;\n\n";
+        out += "                int type = (int) INTS.get(buffer, at + 4);\n";
+        out += "                if (type != PADDING_TYPE) {\n";
+        out += "                    handler.onRecord(type, buffer, at + RECORD_HEADER_SIZE, length - RECORD_HEADER_SIZE);\n";
+        out += "                    consumed++;\n";
+        out += "                }\n\n";
+        out += "                // Zeroed only once handled, everything zeroed is covered by the head store below\n";
+        out += "                int aligned = align(length);\n";
+        out += "                for (int i = 0; i < aligned; i += 8) buffer.putLong(at + i, 0L);\n";
+        out += "                position += aligned;\n";
+        out += "            }\n";
+        out += "        } finally {\n";
+        out += "            if (position != head) LONGS.setRelease(buffer, HEAD, position);\n";
+        out += "        }\n";
+        out += "        return consumed;\n";
+        out += "    }\n\n";
+        out += "    // Consumer: park until a producer publishes or the timeout expires. Native producers\n";
+        out += "    // unpark this thread through the upcall installed with RingBuffer::SetWakeup.\n";
+        out += "    public boolean await(long timeoutNanos) {\n";
+        out += "        INTS.setVolatile(buffer, PARKED, 1);\n";
+        out += "        if (!isEmpty()) {\n";
+        out += "            INTS.setOpaque(buffer, PARKED, 0);\n";
+        out += "            return true;\n";
+        out += "        }\n";
+        out += "        LockSupport.parkNanos(this, timeoutNanos);\n";
+        out += "        INTS.setOpaque(buffer, PARKED, 0);\n";
+        out += "        return !isEmpty();\n";
+        out += "    }\n\n";
+        out += "    // Producer: claim space and commit the remaining bytes of payload, false if the ring is full\n";
+        out += "    public boolean offer(int type, ByteBuffer payload) {\n";
+        out += "        int length = payload.remaining();\n";
+        out += "        if (type < 0 || length > maxPayload()) throw new IllegalArgumentException(\"Invalid RingBuffer record\");\n";
+        out += "        int total = align(RECORD_HEADER_SIZE + length);\n\n";
+        out += "        long tail = (long) LONGS.getAcquire(buffer, TAIL);\n";
+        out += "        while (true) {\n";
+        out += "            long head = (long) LONGS.getAcquire(buffer, HEAD);\n";
+        out += "            int toEnd = capacity - (int) (tail & (capacity - 1));\n";
+        out += "            int padding = total > toEnd ? toEnd : 0;\n";
+        out += "            if (tail + padding + total - head > capacity) return false;\n\n";
+        out += "            long next = tail + padding + total;\n";
+        out += "            if (!multiProducer) {\n";
+        out += "                LONGS.setOpaque(buffer, TAIL, next);\n";
+        out += "            } else {\n";
+        out += "                long witness = (long) LONGS.compareAndExchange(buffer, TAIL, tail, next);\n";
+        out += "                if (witness != tail) {\n";
+        out += "                    tail = witness;\n";
+        out += "                    continue;\n";
+        out += "                }\n";
+        out += "            }\n\n";
+        out += "            if (padding != 0) {\n";
+        out += "                INTS.set(buffer, offset(tail) + 4, PADDING_TYPE);\n";
+        out += "                INTS.setRelease(buffer, offset(tail), padding);\n";
+        out += "            }\n\n";
+        out += "            // The length is written last with release semantics, it commits the record\n";
+        out += "            int at = offset(tail + padding);\n";
+        out += "            INTS.set(buffer, at + 4, type);\n";
+        out += "            ByteBuffer target = buffer.duplicate();\n";
+        out += "            target.position(at + RECORD_HEADER_SIZE);\n";
+        out += "            target.put(payload.duplicate());\n";
+        out += "            INTS.setRelease(buffer, at, RECORD_HEADER_SIZE + length);\n";
+        out += "            wakeConsumer();\n";
+        out += "            return true;\n";
+        out += "        }\n";
+        out += "    }\n\n";
+        out += "    private void wakeConsumer() {\n";
+        out += "        // Pairs with the volatile parked store of the consumer\n";
+        out += "        VarHandle.fullFence();\n";
+        out += "        if ((int) INTS.getOpaque(buffer, PARKED) == 0) return;\n";
+        out += "        if ((int) INTS.getAndSet(buffer, PARKED, 0) != 0 && wakeup != null) wakeup.run();\n";
+        out += "    }\n\n";
+        out += "    private int offset(long position) { return HEADER_SIZE + (int) (position & (capacity - 1)); }\n\n";
+        out += "    private static int align(int length) { return (length + 7) & ~7; }\n";
+        out += "}\n";
+        return out;
+    }
+
+    // Batches fire-and-forget upcalls into one JNI crossing.
+    // Calls are encoded into native storage exposed to Java as a direct ByteBuffer, and a flush
+    // hands the whole batch to dispatch(ByteBuffer commands, int length, int count) on the dispatcher.
+    // Not thread-safe, use one per thread (e.g. thread_local).
+    //
+    // Encoding (native byte order, unaligned): int32 method, int32 argCount, then per argument a
+    // one byte tag followed by the value. Strings ('T') are an int32 byte length plus UTF-8 bytes.
+    class CommandBuffer {
+    public:
+        struct FlushPolicy {
+            size_t maxBytes = 64 * 1024;
+            size_t maxCommands = 1024;
+            std::chrono::milliseconds maxDelay{16};
+        };
+
+        enum Tag : char {
+            kBoolean = 'Z',
+            kByte = 'B',
+            kChar = 'C',
+            kShort = 'S',
+            kInt = 'I',
+            kLong = 'J',
+            kFloat = 'F',
+            kDouble = 'D',
+            kString = 'T'
+        };
+
+        CommandBuffer(JNIEnv* env, jobject dispatcher, const char* methodName = "dispatch")
+                : CommandBuffer(env, dispatcher, methodName, FlushPolicy()) {}
+
+        CommandBuffer(JNIEnv* env, jobject dispatcher, const char* methodName, FlushPolicy policy)
+                : policy_(policy), storage_(policy.maxBytes) {
+            jclass cls = env->GetObjectClass(dispatcher);
+            ScopedLocalRef<jclass> clsRef(env, cls);
+            method_ = GetMethodID(env, cls, methodName, "(Ljava/nio/ByteBuffer;II)V");
+
+            ScopedLocalRef<jobject> buffer(env, env->NewDirectByteBuffer(storage_.data(), static_cast<jlong>(storage_.size())));
+            JNI_CHECK_EXCEPTION(env);
+            if (!buffer.get()) throw JNIException("NewDirectByteBuffer failed");
+
+            dispatcher_ = GlobalRef<jobject>(env, dispatcher);
+            buffer_ = GlobalRef<jobject>(env, buffer.get());
+        }
+
+        // Pending commands are dropped, flush before destruction to deliver them.
+        // The references are released from any thread, e.g. a thread_local destroyed after detaching.
+        ~CommandBuffer() = default;
+
+        // Disable copy
+        CommandBuffer(const CommandBuffer&) = delete;
+        CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+        // Encode one call, flushing first if it would not fit and afterwards if the policy says so.
+        // Arguments must be exactly a JNI primitive type or a string, e.g. jboolean(flag) rather than bool.
+        template <typename... Args>
+        void Append(JNIEnv* env, jint method, const Args&... args) {
+            static_assert((IsEncodable<std::decay_t<Args>>() && ...),
+                          "CommandBuffer arguments must be jboolean, jbyte, jchar, jshort, jint, jlong, jfloat, jdouble or a string");
+
+            size_t size = sizeof(jint) * 2 + (EncodedSize(args) + ... + 0);
+            if (size > storage_.size()) throw JNIException("Command exceeds CommandBuffer capacity");
+            if (used_ + size > storage_.size()) Flush(env);
+
+            if (count_ == 0) oldest_ = std::chrono::steady_clock::now();
+            Put(method);
+            Put(static_cast<jint>(sizeof...(Args)));
+            (Encode(args), ...);
+            ++count_;
+
+            if (count_ >= policy_.maxCommands || used_ >= policy_.maxBytes) {
+                Flush(env);
+            } else {
+                FlushIfDue(env);
+            }
+        }
+
+        // Deliver every pending command with one call
+        void Flush(JNIEnv* env) {
+            if (count_ == 0) return;
+
+            jint length = static_cast<jint>(used_);
+            jint count = static_cast<jint>(count_);
+            used_ = 0;
+            count_ = 0;
+            ++flushes_;
+
+            env->CallVoidMethod(dispatcher_.get(), method_, buffer_.get(), length, count);
+            JNI_CHECK_EXCEPTION(env);
+        }
+
+        // Flush if the oldest pending command waited longer than maxDelay, call from idle loops
+        bool FlushIfDue(JNIEnv* env) {
+            if (count_ == 0 || std::chrono::steady_clock::now() - oldest_ < policy_.maxDelay) return false;
+            Flush(env);
+            return true;
+        }
+
+        size_t pendingCommands() const { return count_; }
+        size_t pendingBytes() const { return used_; }
+        uint64_t flushes() const { return flushes_; }
+
+    private:
+        // Exact matches only, so the size computed here is the size the selected Encode overload writes
+        template <typename T>
+        static constexpr bool IsEncodable() {
+            return std::is_same_v<T, jboolean> || std::is_same_v<T, jbyte> || std::is_same_v<T, jchar> ||
+                   std::is_same_v<T, jshort> || std::is_same_v<T, jint> || std::is_same_v<T, jlong> ||
+                   std::is_same_v<T, jfloat> || std::is_same_v<T, jdouble> ||
+                   std::is_same_v<T, const char*> || std::is_same_v<T, char*> || std::is_same_v<T, std::string>;
+        }
+
+        static size_t EncodedSize(const std::string& value) { return 1 + sizeof(jint) + value.size(); }
+
+        static size_t EncodedSize(const char* value) {
+            if (!value) throw JNIException("Null string passed to CommandBuffer");
+            return 1 + sizeof(jint) + std::strlen(value);
+        }
+
+        template <typename T>
+        static size_t EncodedSize(const T&) { return 1 + sizeof(T); }
+
+        template <typename T>
+        void Put(const T& value) {
+            std::memcpy(storage_.data() + used_, &value, sizeof(T));
+            used_ += sizeof(T);
+        }
+
+        void PutTag(Tag tag) { storage_[used_++] = static_cast<std::byte>(tag); }
+
+        void Encode(jboolean value) { PutTag(kBoolean); Put(value); }
+        void Encode(jbyte value) { PutTag(kByte); Put(value); }
+        void Encode(jchar value) { PutTag(kChar); Put(value); }
+        void Encode(jshort value) { PutTag(kShort); Put(value); }
+        void Encode(jint value) { PutTag(kInt); Put(value); }
+        void Encode(jlong value) { PutTag(kLong); Put(value); }
+        void Encode(jfloat value) { PutTag(kFloat); Put(value); }
+        void Encode(jdouble value) { PutTag(kDouble); Put(value); }
+
+        void Encode(const char* value) { EncodeString(value, std::strlen(value)); }
+        void Encode(const std::string& value) { EncodeString(value.data(), value.size()); }
+
+        void EncodeString(const char* value, size_t length) {
+            PutTag(kString);
+            Put(static_cast<jint>(length));
+            std::memcpy(storage_.data() + used_, value, length);
+            used_ += length;
+        }
+
+        FlushPolicy policy_;
+        std::vector<std::byte> storage_;
+        GlobalRef<jobject> dispatcher_;
+        GlobalRef<jobject> buffer_;
+        jmethodID method_ = nullptr;
+        size_t used_ = 0;
+        size_t count_ = 0;
+        uint64_t flushes_ = 0;
+        std::chrono::steady_clock::time_point oldest_;
+    };
+
+    namespace detail {
+        // Direct ByteBuffer over a native buffer, driven through a byte channel to skip the byte[] copy
+        struct ChannelBuffer {
+            jobject channel = nullptr; // Global reference
+            jobject buffer = nullptr;  // Global reference
+            jmethodID transfer = nullptr;
+            jmethodID clear = nullptr;
+            jmethodID limit = nullptr;
+
+            // Use stream itself if it is a channel, otherwise its getChannel() if it is a File*Stream
+            bool Open(JNIEnv* env, jobject stream, const char* channelClass, const char* fileStreamClass,
+                      const char* transferName, void* storage, size_t size) {
+                jclass channelCls = FindClass(env, channelClass);
+                ScopedLocalRef<jclass> channelClsRef(env, channelCls);
+                jclass fileStreamCls = FindClass(env, fileStreamClass);
+                ScopedLocalRef<jclass> fileStreamClsRef(env, fileStreamCls);
+
+                jobject localChannel = nullptr;
+                if (env->IsInstanceOf(stream, channelCls)) {
+                    localChannel = env->NewLocalRef(stream);
+                } else if (env->IsInstanceOf(stream, fileStreamCls)) {
+                    localChannel = CallMethod<jobject>(env, stream, "getChannel", "()Ljava/nio/channels/FileChannel;");
+                }
+                if (!localChannel) return false;
+                ScopedLocalRef<jobject> channelRef(env, localChannel);
+
+                jclass bufferCls = FindClass(env, "java/nio/Buffer");
+                ScopedLocalRef<jclass> bufferClsRef(env, bufferCls);
+                transfer = GetMethodID(env, channelCls, transferName, "(Ljava/nio/ByteBuffer;)I");
+                clear = GetMethodID(env, bufferCls, "clear", "()Ljava/nio/Buffer;");
+                limit = GetMethodID(env, bufferCls, "limit", "(I)Ljava/nio/Buffer;");
+
+                ScopedLocalRef<jobject> localBuffer(env, env->NewDirectByteBuffer(storage, static_cast<jlong>(size)));
+                JNI_CHECK_EXCEPTION(env);
+                if (!localBuffer.get()) return false;
+
+                channel = env->NewGlobalRef(localChannel);
+                buffer = env->NewGlobalRef(localBuffer.get());
+                return true;
+            }
+
+            // Reset position to 0 and limit to length
+            void Prepare(JNIEnv* env, jint length) {
+                ScopedLocalRef<jobject> cleared(env, env->CallObjectMethod(buffer, clear));
+                JNI_CHECK_EXCEPTION(env);
+                ScopedLocalRef<jobject> limited(env, env->CallObjectMethod(buffer, limit, length));
+                JNI_CHECK_EXCEPTION(env);
+            }
+
+            jint Transfer(JNIEnv* env) {
+                jint result = env->CallIntMethod(channel, transfer, buffer);
+                JNI_CHECK_EXCEPTION(env);
+                return result;
+            }
+
+            void Close(JNIEnv* env) {
+                if (channel) env->DeleteGlobalRef(channel);
+                if (buffer) env->DeleteGlobalRef(buffer);
+                channel = nullptr;
+                buffer = nullptr;
+            }
+        };
+    } // namespace detail
+
+    // std::streambuf reading from a java.io.InputStream (or a ReadableByteChannel) in bulk.
+    // FileInputStreams and channels read straight into native memory through a direct ByteBuffer,
+    // other streams go through one reusable byte[] and GetByteArrayRegion.
+    // Bound to the thread that created it.
+    class JavaInputStreamBuf : public std::streambuf {
+    public:
+        static constexpr size_t kDefaultBufferSize = 64 * 1024;
+
+        JavaInputStreamBuf(JNIEnv* env, jobject stream, size_t bufferSize = kDefaultBufferSize, bool useChannel = true)
+                : env_(env), storage_(bufferSize) {
+            if (bufferSize == 0 || bufferSize > 0x7fffffff) throw JNIException("Invalid stream buffer size");
+
+            if (!useChannel || !channel_.Open(env, stream, "java/nio/channels/ReadableByteChannel",
+                                              "java/io/FileInputStream", "read", storage_.data(), storage_.size())) {
+                jclass cls = FindClass(env, "java/io/InputStream");
+                ScopedLocalRef<jclass> clsRef(env, cls);
+                read_ = GetMethodID(env, cls, "read", "([BII)I");
+
+                ScopedLocalRef<jbyteArray> array(env, JNIArrayTraits<jbyte>::NewArray(env, static_cast<jsize>(bufferSize)));
+                stream_ = env->NewGlobalRef(stream);
+                array_ = static_cast<jbyteArray>(env->NewGlobalRef(array.get()));
+            }
+            setg(storage_.data(), storage_.data(), storage_.data());
+        }
+
+        ~JavaInputStreamBuf() override {
+            channel_.Close(env_);
+            if (stream_) env_->DeleteGlobalRef(stream_);
+            if (array_) env_->DeleteGlobalRef(array_);
+        }
+
+        // Disable copy
+        JavaInputStreamBuf(const JavaInputStreamBuf&) = delete;
+        JavaInputStreamBuf& operator=(const JavaInputStreamBuf&) = delete;
+
+        bool usesChannel() const { return channel_.channel != nullptr; }
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+            jint count = Fill(storage_.data(), static_cast<jint>(storage_.size()));
+            if (count <= 0) return traits_type::eof();
+
+            setg(storage_.data(), storage_.data(), storage_.data() + count);
+            return traits_type::to_int_type(*gptr());
+        }
+
+        // Large reads on the byte[] path copy straight from the Java array into the destination
+        std::streamsize xsgetn(char* s, std::streamsize n) override {
+            std::streamsize total = 0;
+            while (total < n) {
+                std::streamsize buffered = egptr() - gptr();
+                if (buffered > 0) {
+                    std::streamsize chunk = std::min(buffered, n - total);
+                    std::memcpy(s + total, gptr(), static_cast<size_t>(chunk));
+                    gbump(static_cast<int>(chunk));
+                    total += chunk;
+                    continue;
+                }
+
+                std::streamsize remaining = n - total;
+                if (usesChannel() || remaining < static_cast<std::streamsize>(storage_.size())) {
+                    if (traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+                    continue;
+                }
+
+                jint count = Fill(s + total, static_cast<jint>(storage_.size()));
+                if (count <= 0) break;
+                total += count;
+            }
+            return total;
+        }
+
+    private:
+        // Read up to length bytes into destination, which is storage_ on the channel path
+        jint Fill(char* destination, jint length) {
+            if (usesChannel()) {
+                channel_.Prepare(env_, length);
+                return channel_.Transfer(env_);
+            }
+
+            jint count = env_->CallIntMethod(stream_, read_, array_, 0, length);
+            JNI_CHECK_EXCEPTION(env_);
+            if (count > 0) {
+                JNIArrayTraits<jbyte>::GetRegion(env_, array_, 0, count, reinterpret_cast<jbyte*>(destination));
+            }
+            return count;
+        }
+
+        JNIEnv* env_;
+        std::vector<char> storage_;
+        detail::ChannelBuffer channel_;
+        jobject stream_ = nullptr;
+        jbyteArray array_ = nullptr;
+        jmethodID read_ = nullptr;
+    };
+
+    // std::streambuf writing to a java.io.OutputStream (or a WritableByteChannel) in bulk.
+    // FileOutputStreams and channels write straight from native memory through a direct ByteBuffer,
+    // other streams go through one reusable byte[] and SetByteArrayRegion.
+    // Bound to the thread that created it.
+    class JavaOutputStreamBuf : public std::streambuf {
+    public:
+        static constexpr size_t kDefaultBufferSize = 64 * 1024;
+
+        JavaOutputStreamBuf(JNIEnv* env, jobject stream, size_t bufferSize = kDefaultBufferSize, bool useChannel = true)
+                : env_(env), storage_(bufferSize) {
+            if (bufferSize == 0 || bufferSize > 0x7fffffff) throw JNIException("Invalid stream buffer size");
+
+            if (!useChannel || !channel_.Open(env, stream, "java/nio/channels/WritableByteChannel",
+                                              "java/io/FileOutputStream", "write", storage_.data(), storage_.size())) {
+                jclass cls = FindClass(env, "java/io/OutputStream");
+                ScopedLocalRef<jclass> clsRef(env, cls);
+                write_ = GetMethodID(env, cls, "write", "([BII)V");
+                flush_ = GetMethodID(env, cls, "flush", "()V");
+
+                ScopedLocalRef<jbyteArray> array(env, JNIArrayTraits<jbyte>::NewArray(env, static_cast<jsize>(bufferSize)));
+                stream_ = env->NewGlobalRef(stream);
+                array_ = static_cast<jbyteArray>(env->NewGlobalRef(array.get()));
+            }
+            setp(storage_.data(), storage_.data() + storage_.size());
+        }
+
+        // Pending bytes are written, errors at this point are swallowed
+        ~JavaOutputStreamBuf() override {
+            try {
+                Drain();
+            } catch (const JNIException&) {
+            }
+            channel_.Close(env_);
+            if (stream_) env_->DeleteGlobalRef(stream_);
+            if (array_) env_->DeleteGlobalRef(array_);
+        }
+
+        // Disable copy
+        JavaOutputStreamBuf(const JavaOutputStreamBuf&) = delete;
+        JavaOutputStreamBuf& operator=(const JavaOutputStreamBuf&) = delete;
+
+        bool usesChannel() const { return channel_.channel != nullptr; }
+
+    protected:
+        int_type overflow(int_type ch) override {
+            Drain();
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+
+        int sync() override {
+            Drain();
+            if (flush_) {
+                env_->CallVoidMethod(stream_, flush_);
+                JNI_CHECK_EXCEPTION(env_);
+            }
+            return 0;
+        }
+
+        // Large writes on the byte[] path copy straight from the source into the Java array
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            std::streamsize capacity = static_cast<std::streamsize>(storage_.size());
+            if (usesChannel() || n < capacity) return std::streambuf::xsputn(s, n);
+
+            Drain();
+            for (std::streamsize offset = 0; offset < n; offset += capacity) {
+                Emit(s + offset, static_cast<jint>(std::min(capacity, n - offset)));
+            }
+            return n;
+        }
+
+    private:
+        void Drain() {
+            jint length = static_cast<jint>(pptr() - pbase());
+            if (length > 0) Emit(pbase(), length);
+            setp(storage_.data(), storage_.data() + storage_.size());
+        }
+
+        // Write length bytes from source, which is storage_ on the channel path.
+        // A non-blocking channel may accept nothing; that is retried a bounded number of times.
+        void Emit(const char* source, jint length) {
+            if (usesChannel()) {
+                channel_.Prepare(env_, length);
+                int idle = 0;
+                for (jint written = 0; written < length;) {
+                    jint count = channel_.Transfer(env_);
+                    if (count < 0) throw JNIException("WritableByteChannel write failed");
+                    if (count == 0) {
+                        if (++idle > kMaxIdleWrites) throw JNIException("WritableByteChannel accepts no data");
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    idle = 0;
+                    written += count;
+                }
+                return;
+            }
+
+            JNIArrayTraits<jbyte>::SetRegion(env_, array_, 0, length, reinterpret_cast<const jbyte*>(source));
+            env_->CallVoidMethod(stream_, write_, array_, 0, length);
+            JNI_CHECK_EXCEPTION(env_);
+        }
+
+        static constexpr int kMaxIdleWrites = 1000;
+
+        JNIEnv* env_;
+        std::vector<char> storage_;
+        detail::ChannelBuffer channel_;
+        jobject stream_ = nullptr;
+        jbyteArray array_ = nullptr;
+        jmethodID write_ = nullptr;
+        jmethodID flush_ = nullptr;
+    };
+
+    // Owning file descriptor, closed on destruction
+    class UniqueFd {
+    public:
+        UniqueFd() = default;
+        explicit UniqueFd(int fd) : fd_(fd) {}
+
+        ~UniqueFd() { reset(); }
+
+        UniqueFd(UniqueFd&& other) noexcept : fd_(other.release()) {}
+
+        UniqueFd& operator=(UniqueFd&& other) noexcept {
+            if (this != &other) reset(other.release());
+            return *this;
+        }
+
+        // Disable copy
+        UniqueFd(const UniqueFd&) = delete;
+        UniqueFd& operator=(const UniqueFd&) = delete;
+
+        int get() const { return fd_; }
+        explicit operator bool() const { return fd_ >= 0; }
+
+        int release() {
+            int temp = fd_;
+            fd_ = -1;
+            return temp;
+        }
+
+        void reset(int fd = -1) {
+            if (fd_ >= 0) ::close(fd_);
+            fd_ = fd;
+        }
+
+    private:
+        int fd_ = -1;
+    };
+
+    namespace detail {
+        // Method ID or nullptr if the class has no such method
+        inline jmethodID FindMethodOrNull(JNIEnv* env, jclass cls, const char* methodName, const char* signature) {
+            jmethodID mid = env->GetMethodID(cls, methodName, signature);
+            if (env->ExceptionCheck()) env->ExceptionClear();
+            return mid;
+        }
+    } // namespace detail
+
+    // Borrow the descriptor of a java.io.FileDescriptor, it stays owned by the Java object
+    inline int GetFileDescriptor(JNIEnv* env, jobject fileDescriptor) {
+        // java.io.FileDescriptor is a boot class and never unloaded, the field ID stays valid
+        static jfieldID descriptorField = [env] {
+            jclass cls = FindClass(env, "java/io/FileDescriptor");
+            ScopedLocalRef<jclass> clsRef(env, cls);
+            return GetFieldID(env, cls, "descriptor", "I");
+        }();
+
+        jint fd = env->GetIntField(fileDescriptor, descriptorField);
+        JNI_CHECK_EXCEPTION(env);
+        return fd;
+    }
+
+    // Borrow the descriptor behind a java.io.FileDescriptor, an object with int getFd()
+    // (ParcelFileDescriptor) or an object with FileDescriptor getFD()/getFileDescriptor()
+    // (FileInputStream, FileOutputStream, RandomAccessFile, ...).
+    // The descriptor is only valid while the Java object stays open.
+    inline int GetFd(JNIEnv* env, jobject obj) {
+        if (!obj) throw JNIException("GetFd called with null object");
+
+        jclass fileDescriptorCls = FindClass(env, "java/io/FileDescriptor");
+        ScopedLocalRef<jclass> fileDescriptorClsRef(env, fileDescriptorCls);
+        if (env->IsInstanceOf(obj, fileDescriptorCls)) return GetFileDescriptor(env, obj);
+
+        jclass cls = env->GetObjectClass(obj);
+        ScopedLocalRef<jclass> clsRef(env, cls);
+
+        if (jmethodID getFd = detail::FindMethodOrNull(env, cls, "getFd", "()I")) {
+            jint fd = env->CallIntMethod(obj, getFd);
+            JNI_CHECK_EXCEPTION(env);
+            return fd;
+        }
+
+        for (const char* methodName : {"getFD", "getFileDescriptor"}) {
+            if (jmethodID getter = detail::FindMethodOrNull(env, cls, methodName, "()Ljava/io/FileDescriptor;")) {
+                ScopedLocalRef<jobject> fileDescriptor(env, env->CallObjectMethod(obj, getter));
+                JNI_CHECK_EXCEPTION(env);
+                if (!fileDescriptor.get()) throw JNIException("Object has no file descriptor");
+                return GetFileDescriptor(env, fileDescriptor.get());
+            }
+        }
+        throw JNIException("Object does not expose a file descriptor");
+    }
+
+    // Duplicate the descriptor GetFd would borrow, the copy is owned and closed natively
+    inline UniqueFd DupFd(JNIEnv* env, jobject obj) {
+        int fd = GetFd(env, obj);
+        if (fd < 0) throw JNIException("Object has an invalid file descriptor");
+
+        int copy = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (copy < 0) throw JNIException((std::string("fcntl(F_DUPFD_CLOEXEC) failed: ") + std::strerror(errno)).c_str());
+        return UniqueFd(copy);
+    }
+
+    // Reference from a flat record to a string or vector stored in the batch heap
+    struct FlatSpan {
+        int32_t offset; // Bytes from the start of the heap
+        int32_t count;  // Bytes for strings, elements for vectors
+    };
+
+    // Describes one field of a flat schema, used to generate the Java accessor
+    struct FlatField {
+        const char* name;
+        const char* signature; // JNI signature, "Ljava/lang/String;" for strings, "[T" for vectors
+        size_t offset;
+    };
+
+    // Flat batch layout, native byte order:
+    //   [0]  int32 recordCount
+    //   [4]  int32 recordSize
+    //   [8]  int32 heapOffset
+    //   [12] int32 heapSize
+    //   [16] recordCount fixed-size records, every field at a fixed offset and naturally aligned
+    //   [heapOffset] strings (UTF-8) and vectors referenced by FlatSpan, 8-byte aligned
+    struct FlatHeader {
+        int32_t recordCount;
+        int32_t recordSize;
+        int32_t heapOffset;
+        int32_t heapSize;
+    };
+
+    // Schema declaration through an X-macro listing fields, strings and vectors:
+    //
+    //   #define POINT_FIELDS(FIELD, STRING, VECTOR) FIELD(jint, id) FIELD(jdouble, x) STRING(label) VECTOR(jfloat, samples)
+    //   JNI_FLAT_SCHEMA(Point, POINT_FIELDS)
+#define JNI_FLAT_DECLARE_FIELD(type, name) alignas(sizeof(type)) type name;
+#define JNI_FLAT_DECLARE_SPAN(name) alignas(4) jni::FlatSpan name;
+#define JNI_FLAT_DECLARE_VECTOR(type, name) JNI_FLAT_DECLARE_SPAN(name)
+#define JNI_FLAT_DESCRIBE_FIELD(type, name) jni::FlatField{#name, jni::JNITypeTraits<type>::signature, offsetof(Self, name)},
+#define JNI_FLAT_DESCRIBE_STRING(name) jni::FlatField{#name, "Ljava/lang/String;", offsetof(Self, name)},
+#define JNI_FLAT_DESCRIBE_VECTOR(type, name) jni::FlatField{#name, jni::JNIArrayTraits<type>::signature, offsetof(Self, name)},
+
+#define JNI_FLAT_SCHEMA(Name, FIELDS)                                                       \
+    struct Name {                                                                           \
+        FIELDS(JNI_FLAT_DECLARE_FIELD, JNI_FLAT_DECLARE_SPAN, JNI_FLAT_DECLARE_VECTOR)      \
+                                                                                            \
+        static std::vector<jni::FlatField> Fields() {                                       \
+            using Self = Name;                                                              \
+            return {FIELDS(JNI_FLAT_DESCRIBE_FIELD, JNI_FLAT_DESCRIBE_STRING, JNI_FLAT_DESCRIBE_VECTOR)}; \
+        }                                                                                   \
+    };                                                                                      \
+    static_assert(std::is_standard_layout_v<Name> && std::is_trivially_copyable_v<Name>,   \
+                  "Flat schema must be a standard-layout trivially copyable type")
+
+    // Builds a flat batch of Schema records, the result can be written straight into a direct buffer
+    template <typename Schema>
+    class FlatBuilder {
+    public:
+        explicit FlatBuilder(size_t expectedRecords = 0) { records_.reserve(expectedRecords); }
+
+        // Append a zeroed record, the reference is invalidated by the next Add
+        Schema& Add() {
+            records_.emplace_back();
+            std::memset(&records_.back(), 0, sizeof(Schema));
+            return records_.back();
+        }
+
+        FlatSpan String(const std::string& value) { return Append(value.data(), value.size(), 1, value.size()); }
+
+        template <typename T>
+        FlatSpan Vector(const T* data, size_t count) {
+            static_assert(std::is_arithmetic_v<T>, "Flat vectors hold primitive elements");
+            return Append(data, count * sizeof(T), alignof(T), count);
+        }
+
+        size_t records() const { return records_.size(); }
+
+        // Total bytes Finish writes
+        size_t size() const { return HeapOffset() + heap_.size(); }
+
+        // Write the batch into destination, which must be 8-byte aligned and hold size() bytes
+        void Finish(void* destination, size_t capacity) const {
+            if (capacity < size()) throw JNIException("Flat batch does not fit the destination");
+
+            auto* out = static_cast<std::byte*>(destination);
+            FlatHeader header{static_cast<int32_t>(records_.size()), static_cast<int32_t>(sizeof(Schema)),
+                              static_cast<int32_t>(HeapOffset()), static_cast<int32_t>(heap_.size())};
+            std::memset(out, 0, HeapOffset());
+            std::memcpy(out, &header, sizeof(header));
+            if (!records_.empty()) std::memcpy(out + sizeof(FlatHeader), records_.data(), records_.size() * sizeof(Schema));
+            if (!heap_.empty()) std::memcpy(out + HeapOffset(), heap_.data(), heap_.size());
+        }
+
+        void Clear() {
+            records_.clear();
+            heap_.clear();
+        }
+
+    private:
+        static constexpr size_t kHeapAlignment = 8;
+
+        size_t HeapOffset() const {
+            size_t end = sizeof(FlatHeader) + records_.size() * sizeof(Schema);
+            return (end + kHeapAlignment - 1) & ~(kHeapAlignment - 1);
+        }
+
+        FlatSpan Append(const void* data, size_t bytes, size_t alignment, size_t count) {
+            size_t offset = (heap_.size() + alignment - 1) & ~(alignment - 1);
+            if (offset + bytes > 0x7fffffff) throw JNIException("Flat batch heap exceeds 2 GB");
+
+            heap_.resize(offset + bytes);
+            if (bytes) std::memcpy(heap_.data() + offset, data, bytes);
+            return {static_cast<int32_t>(offset), static_cast<int32_t>(count)};
+        }
+
+        std::vector<Schema> records_;
+        std::vector<std::byte> heap_;
+    };
+
+    // Reads a flat batch in place, e.g. one Java filled through absolute ByteBuffer puts
+    template <typename Schema>
+    class FlatReader {
+    public:
+        FlatReader(const void* data, size_t size) : data_(static_cast<const std::byte*>(data)) {
+            if (size < sizeof(FlatHeader)) throw JNIException("Flat batch too small");
+            std::memcpy(&header_, data_, sizeof(header_));
+
+            // 64-bit arithmetic, the int32 header fields cannot wrap it even where size_t is 32 bits
+            uint64_t recordsEnd = sizeof(FlatHeader) + static_cast<uint64_t>(header_.recordCount) * sizeof(Schema);
+            if (header_.recordCount < 0 || header_.recordSize != static_cast<int32_t>(sizeof(Schema)) ||
+                header_.heapOffset < 0 || header_.heapSize < 0 ||
+                static_cast<uint64_t>(header_.heapOffset) < recordsEnd ||
+                static_cast<uint64_t>(header_.heapOffset) + static_cast<uint64_t>(header_.heapSize) > size) {
+                throw JNIException("Malformed flat batch");
+            }
+        }
+
+        FlatReader(JNIEnv* env, jobject directBuffer)
+                : FlatReader(jni::GetDirectBufferAddress(env, directBuffer),
+                             static_cast<size_t>(jni::GetDirectBufferCapacity(env, directBuffer))) {}
+
+        size_t size() const { return static_cast<size_t>(header_.recordCount); }
+
+        const Schema& operator[](size_t index) const {
+            if (index >= size()) throw JNIException("Flat record index out of range");
+            return *reinterpret_cast<const Schema*>(data_ + sizeof(FlatHeader) + index * sizeof(Schema));
+        }
+
+        std::string_view String(FlatSpan span) const {
+            CheckSpan(span, static_cast<uint64_t>(span.count));
+            return {reinterpret_cast<const char*>(Heap() + span.offset), static_cast<size_t>(span.count)};
+        }
+
+        template <typename T>
+        const T* Vector(FlatSpan span) const {
+            CheckSpan(span, static_cast<uint64_t>(span.count) * sizeof(T));
+            return reinterpret_cast<const T*>(Heap() + span.offset);
+        }
+
+    private:
+        const std::byte* Heap() const { return data_ + header_.heapOffset; }
+
+        void CheckSpan(FlatSpan span, uint64_t bytes) const {
+            if (span.offset < 0 || span.count < 0 || static_cast<uint64_t>(span.offset) + bytes > static_cast<uint64_t>(header_.heapSize)) {
+                throw JNIException("Flat span out of range");
+            }
+        }
+
+        const std::byte* data_;
+        FlatHeader header_;
+    };
+
+    // Generate a Java accessor class reading Schema records with absolute ByteBuffer gets.
+    // The ByteBuffer must use ByteOrder.nativeOrder().
+    template <typename Schema>
+    std::string GenerateFlatJavaAccessor(const std::string& packageName, const std::string& className) {
+        std::string out;
+        if (!packageName.empty()) out += "package " + packageName + ";\n\n";
+        out += "import java.nio.ByteBuffer;\nimport java.nio.charset.StandardCharsets;\n\n";
+        out += "// Generated by jni::GenerateFlatJavaAccessor, do not edit\n";
+        out += "public final class " + className + " {\n";
+        out += "    public static final int RECORD_SIZE = " + std::to_string(sizeof(Schema)) + ";\n";
+        out += "    private static final int HEADER_SIZE = " + std::to_string(sizeof(FlatHeader)) + ";\n";
+
+        std::vector<FlatField> fields = Schema::Fields();
+        for (const FlatField& field : fields) {
+            std::string constant = field.name;
+            std::transform(constant.begin(), constant.end(), constant.begin(), [](unsigned char c) { return std::toupper(c); });
+            out += "    public static final int " + constant + " = " + std::to_string(field.offset) + ";\n";
+        }
+
+        out += "\n    private " + className + "() {}\n\n";
+        out += "    public static int count(ByteBuffer b) { return b.getInt(0); }\n";
+        out += "    private static int heap(ByteBuffer b) { return b.getInt(8); }\n";
+        out += "    private static int record(int i) { return HEADER_SIZE + i * RECORD_SIZE; }\n";
+
+        for (const FlatField& field : fields) {
+            std::string constant = field.name;
+            std::transform(constant.begin(), constant.end(), constant.begin(), [](unsigned char c) { return std::toupper(c); });
+            std::string at = "record(i) + " + constant;
+            std::string prefix = std::string("    public static ");
+
+            switch (field.signature[0]) {
+                case 'Z': out += prefix + "boolean " + field.name + "(ByteBuffer b, int i) { return b.get(" + at + ") != 0; }\n"; break;
+                case 'B': out += prefix + "byte " + field.name + "(ByteBuffer b, int i) { return b.get(" + at + "); }\n"; break;
+                case 'C': out += prefix + "char " + field.name + "(ByteBuffer b, int i) { return b.getChar(" + at + "); }\n"; break;
+                case 'S': out += prefix + "short " + field.name + "(ByteBuffer b, int i) { return b.getShort(" + at + "); }\n"; break;
+                case 'I': out += prefix + "int " + field.name + "(ByteBuffer b, int i) { return b.getInt(" + at + "); }\n"; break;
+                case 'J': out += prefix + "long " + field.name + "(ByteBuffer b, int i) { return b.getLong(" + at + "); }\n"; break;
+                case 'F': out += prefix + "float " + field.name + "(ByteBuffer b, int i) { return b.getFloat(" + at + "); }\n"; break;
+                case 'D': out += prefix + "double " + field.name + "(ByteBuffer b, int i) { return b.getDouble(" + at + "); }\n"; break;
+                case 'L':
+                    out += prefix + "String " + field.name + "(ByteBuffer b, int i) {\n";
+                    out += "        byte[] bytes = new byte[b.getInt(" + at + " + 4)];\n";
+                    out += "        ByteBuffer view = b.duplicate();\n";
+                    out += "        view.position(heap(b) + b.getInt(" + at + "));\n";
+                    out += "        view.get(bytes);\n";
+                    out += "        return new String(bytes, StandardCharsets.UTF_8);\n";
+                    out += "    }\n";
+                    break;
+                default:
+                    // Vectors: absolute byte offset of the first element and element count
+                    out += prefix + "int " + field.name + "Offset(ByteBuffer b, int i) { return heap(b) + b.getInt(" + at + "); }\n";
+                    out += prefix + "int " + field.name + "Count(ByteBuffer b, int i) { return b.getInt(" + at + " + 4); }\n";
+                    break;
+            }
+        }
+        out += "}\n";
+        return out;
+    }
+
+    // Shared memory region backed by memfd_create (or a named shm_open object off Android),
+    // mapped read-write and exposable as direct ByteBuffers in every process that maps it.
+    // The descriptor can be handed to other processes with SendFd/ReceiveFd over a Unix socket.
+    class SharedMemory {
+    public:
+        SharedMemory() = default;
+
+        // Anonymous region, its size is sealed so peers cannot shrink it under a mapping
+        static SharedMemory Create(const std::string& name, size_t size) {
+            int fd = static_cast<int>(::syscall(SYS_memfd_create, name.c_str(), kMemfdCloexec | kMemfdAllowSealing));
+            if (fd < 0) throw JNIException(SystemError("memfd_create", name).c_str());
+
+            UniqueFd owned(fd);
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0) throw JNIException(SystemError("ftruncate", name).c_str());
+            if (::fcntl(fd, kAddSeals, kSealShrink | kSealGrow) != 0) throw JNIException(SystemError("fcntl(F_ADD_SEALS)", name).c_str());
+            return FromFd(std::move(owned));
+        }
+
+#ifndef __ANDROID__
+        // Named POSIX region, created with the given size if it does not exist yet
+        static SharedMemory Open(const std::string& name, size_t size) {
+            int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (fd < 0) throw JNIException(SystemError("shm_open", name).c_str());
+
+            UniqueFd owned(fd);
+            struct stat info {};
+            if (::fstat(fd, &info) != 0) throw JNIException(SystemError("fstat", name).c_str());
+            if (info.st_size == 0 && ::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                throw JNIException(SystemError("ftruncate", name).c_str());
+            }
+            return FromFd(std::move(owned));
+        }
+
+        static void Unlink(const std::string& name) { ::shm_unlink(name.c_str()); }
+#endif
+
+        // Map a region received from another process, e.g. through ReceiveFd
+        static SharedMemory FromFd(UniqueFd fd) {
+            SharedMemory result;
+            result.mapping_ = MappedFile::FromFd(fd.get(), MappedFile::Mode::ReadWrite, MappedFile::Advice::Normal, "shared memory");
+            result.fd_ = std::move(fd);
+            return result;
+        }
+
+        int fd() const { return fd_.get(); }
+        std::byte* data() const { return mapping_.data(); }
+        size_t size() const { return mapping_.size(); }
+        const MappedFile& mapping() const { return mapping_; }
+
+#if JNI_HELPER_HAS_SPAN
+        std::span<std::byte> span() const { return mapping_.span(); }
+#endif
+
+        // A direct ByteBuffer over [offset, offset + length), returned as a local reference
+        jobject CreateBuffer(JNIEnv* env, size_t offset, size_t length) const { return mapping_.CreateBuffer(env, offset, length); }
+        jobject CreateBuffer(JNIEnv* env) const { return mapping_.CreateBuffer(env, 0, size()); }
+
+        // Pass a descriptor over a connected Unix domain socket with SCM_RIGHTS
+        static void SendFd(int socket, int fd) {
+            char payload = 0;
+            iovec io{&payload, 1};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+            msghdr message{};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            cmsghdr* header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+            if (::sendmsg(socket, &message, MSG_NOSIGNAL) < 0) throw JNIException(SystemError("sendmsg", "SCM_RIGHTS").c_str());
+        }
+
+        static UniqueFd ReceiveFd(int socket) {
+            char payload = 0;
+            iovec io{&payload, 1};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+            msghdr message{};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            if (::recvmsg(socket, &message, MSG_CMSG_CLOEXEC) <= 0) throw JNIException(SystemError("recvmsg", "SCM_RIGHTS").c_str());
+
+            cmsghdr* header = CMSG_FIRSTHDR(&message);
+            if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                throw JNIException("No file descriptor received");
+            }
+
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+            return UniqueFd(fd);
+        }
+
+    private:
+        // Kernel ABI values, not every libc exposes them
+        static constexpr unsigned kMemfdCloexec = 0x0001u;
+        static constexpr unsigned kMemfdAllowSealing = 0x0002u;
+        static constexpr int kAddSeals = 1033;
+        static constexpr int kSealShrink = 0x0002;
+        static constexpr int kSealGrow = 0x0004;
+
+        static std::string SystemError(const char* call, const std::string& name) {
+            return std::string(call) + "(" + name + ") failed: " + std::strerror(errno);
+        }
+
+        UniqueFd fd_;
+        MappedFile mapping_;
+    };
+
+    // Asynchronous file reads into native memory or direct ByteBuffer slices.
+    // Uses raw io_uring syscalls when the kernel allows it, otherwise a pool of pread threads.
+    // Completions are delivered in batches from one delivery thread, either to a native handler
+    // or to target.method(ByteBuffer completions, int count) with one upcall per batch.
+    // Each completion is 16 bytes: int64 userData, int32 result (bytes read or -errno), int32 reserved.
+    class AsyncFileReader {
+    public:
+        struct Completion {
+            uint64_t userData;
+            int32_t result;
+            int32_t reserved;
+        };
+
+        struct Options {
+            unsigned queueDepth = 64;     // Reads in flight at most
+            unsigned batchSize = 32;      // Completions per delivery at most
+            unsigned fallbackThreads = 4; // pread threads when io_uring is unavailable
+            bool useIoUring = true;
+            // Receives batches that could not be handed to Java, e.g. when the delivery thread cannot attach
+            std::function<void(const char* error, const Completion* completions, size_t count)> onDeliveryError;
+        };
+
+        struct Stats {
+            bool ioUring;
+            size_t inFlight;
+            size_t queueDepth;
+            uint64_t submitted;
+            uint64_t completed;
+            uint64_t batches;
+            uint64_t undelivered;    // Completions that never reached Java
+            uint64_t totalLatencyNs; // Submit to completion, summed over completed reads
+            uint64_t maxLatencyNs;
+        };
+
+        using Handler = std::function<void(const Completion*, size_t)>;
+
+        explicit AsyncFileReader(Handler handler) : AsyncFileReader(std::move(handler), Options()) {}
+
+        AsyncFileReader(Handler handler, Options options) : options_(Normalize(options)), handler_(std::move(handler)) {
+            Start();
+        }
+
+        AsyncFileReader(JNIEnv* env, jobject target, const char* methodName = "onReadsComplete")
+                : AsyncFileReader(env, target, methodName, Options()) {}
+
+        AsyncFileReader(JNIEnv* env, jobject target, const char* methodName, Options options) : options_(Normalize(options)) {
+            if (env->GetJavaVM(&vm_) != JNI_OK) throw JNIException("GetJavaVM failed");
+
+            jclass cls = env->GetObjectClass(target);
+            ScopedLocalRef<jclass> clsRef(env, cls);
+            method_ = GetMethodID(env, cls, methodName, "(Ljava/nio/ByteBuffer;I)V");
+            target_ = GlobalRef<jobject>(env, target);
+            Start();
+        }
+
+        // Waits for every read in flight to complete and be delivered
+        ~AsyncFileReader() {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                stopping_ = true;
+#ifdef JNI_HELPER_HAS_IO_URING
+                // EBUSY clears once the delivery thread reaps completions, which needs the lock;
+                // a delivery thread that already stopped reaps nothing and needs no wakeup
+                while (ring_.fd >= 0 && !deliveryStopped_) {
+                    int error = PushSqe(IORING_OP_NOP, -1, 0, nullptr, kWakeup);
+                    if (error != EAGAIN && error != EBUSY) break;
+                    lock.unlock();
+                    std::this_thread::yield();
+                    lock.lock();
+                }
+#endif
+            }
+            pendingReady_.notify_all();
+            completedReady_.notify_all();
+
+            for (std::thread& worker : workers_) worker.join();
+            if (delivery_.joinable()) delivery_.join();
+
+#ifdef JNI_HELPER_HAS_IO_URING
+            ring_.Close();
+#endif
+        }
+
+        // Disable copy
+        AsyncFileReader(const AsyncFileReader&) = delete;
+        AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+        // Queue a read of length bytes at offset into destination, false if the queue is full.
+        // Throws if io_uring refuses the submission for a reason other than being busy.
+        bool Submit(int fd, uint64_t offset, void* destination, size_t length, uint64_t userData) {
+            return Enqueue(fd, offset, destination, length, userData, GlobalRef<jobject>());
+        }
+
+        // Queue a read into [bufferOffset, bufferOffset + length) of a direct ByteBuffer.
+        // The buffer is kept reachable until its completion has been delivered.
+        bool Submit(JNIEnv* env, int fd, uint64_t offset, jobject directBuffer, size_t bufferOffset, size_t length, uint64_t userData) {
+            auto* address = static_cast<std::byte*>(jni::GetDirectBufferAddress(env, directBuffer));
+            size_t capacity = static_cast<size_t>(jni::GetDirectBufferCapacity(env, directBuffer));
+            if (bufferOffset > capacity || length > capacity - bufferOffset) throw JNIException("Read exceeds the direct buffer");
+            return Enqueue(fd, offset, address + bufferOffset, length, userData, GlobalRef<jobject>(env, directBuffer));
+        }
+
+        bool usesIoUring() const {
+#ifdef JNI_HELPER_HAS_IO_URING
+            return ring_.fd >= 0;
+#else
+            return false;
+#endif
+        }
+
+        Stats stats() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return {usesIoUring(), inFlight_, options_.queueDepth, submitted_, completed_, batches_, undelivered_,
+                    totalLatencyNs_, maxLatencyNs_};
+        }
+
+    private:
+        static constexpr uint64_t kWakeup = ~uint64_t{0};
+
+        struct Slot {
+            iovec io{};
+            int fd = -1;
+            uint64_t offset = 0;
+            uint64_t userData = 0;
+            std::chrono::steady_clock::time_point submitted;
+            GlobalRef<jobject> buffer; // Keeps a Java buffer alive while the kernel writes into it
+        };
+
+        bool Enqueue(int fd, uint64_t offset, void* destination, size_t length, uint64_t userData, GlobalRef<jobject> buffer) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_ || deliveryStopped_ || free_.empty()) return false;
+
+            uint32_t index = free_.back();
+            free_.pop_back();
+            Slot& slot = slots_[index];
+            slot.buffer = std::move(buffer);
+            slot.io = {destination, length};
+            slot.fd = fd;
+            slot.offset = offset;
+            slot.userData = userData;
+            slot.submitted = std::chrono::steady_clock::now();
+            ++inFlight_;
+            ++submitted_;
+
+#ifdef JNI_HELPER_HAS_IO_URING
+            if (ring_.fd >= 0) {
+                int error = PushSqe(IORING_OP_READV, fd, offset, &slot.io, index);
+                if (error == 0) return true;
+
+                // Not queued, hand the slot back
+                slot.buffer.reset();
+                free_.push_back(index);
+                --inFlight_;
+                --submitted_;
+                if (error == EAGAIN || error == EBUSY) return false;
+                throw JNIException((std::string("io_uring_enter failed: ") + std::strerror(error)).c_str());
+            }
+#endif
+            pending_.push_back(index);
+            pendingReady_.notify_one();
+            return true;
+        }
+
+        static Options Normalize(Options options) {
+            options.queueDepth = std::max(1u, options.queueDepth);
+            options.batchSize = std::max(1u, options.batchSize);
+            options.fallbackThreads = std::max(1u, options.fallbackThreads);
+            return options;
+        }
+
+        void Start() {
+            slots_.resize(options_.queueDepth);
+            batch_.resize(options_.batchSize);
+            for (uint32_t i = options_.queueDepth; i-- > 0;) free_.push_back(i);
+
+#ifdef JNI_HELPER_HAS_IO_URING
+            if (options_.useIoUring && ring_.Open(options_.queueDepth)) {
+                delivery_ = std::thread([this] { RunRing(); });
+                return;
+            }
+#endif
+            for (unsigned i = 0; i < options_.fallbackThreads; ++i) workers_.emplace_back([this] { RunWorker(); });
+            delivery_ = std::thread([this] { RunFallbackDelivery(); });
+        }
+
+        // Record a finished read into the batch, returns true when the batch is full
+        bool Finish(uint32_t index, int32_t result, size_t& count) {
+            auto now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(mutex_);
+            Slot& slot = slots_[index];
+            auto latency = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - slot.submitted).count());
+            totalLatencyNs_ += latency;
+            maxLatencyNs_ = std::max(maxLatencyNs_, latency);
+            ++completed_;
+            --inFlight_;
+
+            batch_[count++] = {slot.userData, result, 0};
+            if (slot.buffer) pinned_.push_back(slot.buffer.release());
+            free_.push_back(index);
+            return count == batch_.size();
+        }
+
+        void Deliver(size_t& count) {
+            if (count == 0) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++batches_;
+            }
+
+            if (handler_) {
+                handler_(batch_.data(), count);
+            } else if (target_) {
+                DeliverToJava(count);
+            }
+            count = 0;
+            ReleasePinned();
+        }
+
+        // Drop the buffer references of delivered reads, with the delivery env when there is one
+        void ReleasePinned() {
+            std::vector<jobject> pinned;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (pinned_.empty()) return;
+                pinned.swap(pinned_);
+            }
+
+            auto release = [&pinned](JNIEnv* env) {
+                for (jobject buffer : pinned) env->DeleteGlobalRef(buffer);
+            };
+            if (deliveryEnv_) {
+                release(deliveryEnv_);
+            } else {
+                detail::WithAnyThreadEnv(release);
+            }
+        }
+
+        // Runs on the delivery thread, which attaches to the VM on first use
+        void DeliverToJava(size_t count) {
+            if (!deliveryBuffer_ && !AttachDelivery()) {
+                ReportUndelivered("AsyncFileReader could not attach its delivery thread", count);
+                return;
+            }
+
+            deliveryEnv_->CallVoidMethod(target_.get(), method_, deliveryBuffer_, static_cast<jint>(count));
+            if (deliveryEnv_->ExceptionCheck()) {
+                // Nothing above this thread can handle it
+                deliveryEnv_->ExceptionDescribe();
+                deliveryEnv_->ExceptionClear();
+            }
+        }
+
+        bool AttachDelivery() {
+            if (!deliveryEnv_) {
+                JavaVMAttachArgs args{JNI_VERSION_1_6, "AsyncFileReader", nullptr};
+                if (vm_->AttachCurrentThreadAsDaemon(&deliveryEnv_, &args) != JNI_OK) {
+                    deliveryEnv_ = nullptr;
+                    return false;
+                }
+            }
+
+            jobject buffer = deliveryEnv_->NewDirectByteBuffer(batch_.data(), static_cast<jlong>(batch_.size() * sizeof(Completion)));
+            if (buffer) {
+                deliveryBuffer_ = deliveryEnv_->NewGlobalRef(buffer);
+                deliveryEnv_->DeleteLocalRef(buffer);
+            }
+            if (!deliveryBuffer_ && deliveryEnv_->ExceptionCheck()) {
+                deliveryEnv_->ExceptionDescribe();
+                deliveryEnv_->ExceptionClear();
+            }
+            return deliveryBuffer_ != nullptr;
+        }
+
+        void ReportUndelivered(const char* error, size_t count) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                undelivered_ += count;
+            }
+            if (options_.onDeliveryError) options_.onDeliveryError(error, batch_.data(), count);
+        }
+
+        void DetachDelivery() {
+            if (!deliveryEnv_) return;
+            if (deliveryBuffer_) deliveryEnv_->DeleteGlobalRef(deliveryBuffer_);
+            vm_->DetachCurrentThread();
+            deliveryEnv_ = nullptr;
+        }
+
+        void RunWorker() {
+            while (true) {
+                uint32_t index;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    pendingReady_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+                    if (pending_.empty()) return;
+                    index = pending_.front();
+                    pending_.pop_front();
+                }
+
+                Slot& slot = slots_[index];
+                ssize_t result;
+                do {
+                    result = ::pread(slot.fd, slot.io.iov_base, slot.io.iov_len, static_cast<off_t>(slot.offset));
+                } while (result < 0 && errno == EINTR);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    completedQueue_.push_back({index, result < 0 ? -errno : static_cast<int32_t>(result)});
+                }
+                completedReady_.notify_one();
+            }
+        }
+
+        void RunFallbackDelivery() {
+            size_t count = 0;
+            while (true) {
+                std::deque<std::pair<uint32_t, int32_t>> ready;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    completedReady_.wait(lock, [this] { return !completedQueue_.empty() || (stopping_ && inFlight_ == 0); });
+                    if (completedQueue_.empty()) break;
+                    ready.swap(completedQueue_);
+                }
+
+                for (auto [index, result] : ready) {
+                    if (Finish(index, result, count)) Deliver(count);
+                }
+                Deliver(count);
+            }
+            DetachDelivery();
+        }
+
+#ifdef JNI_HELPER_HAS_IO_URING
+        // Minimal io_uring on raw syscalls, mutated only under mutex_ (submission) or by the delivery thread (completion)
+        struct Ring {
+            int fd = -1;
+            void* sqRing = nullptr;
+            void* cqRing = nullptr;
+            size_t sqRingSize = 0;
+            size_t cqRingSize = 0;
+            io_uring_sqe* sqes = nullptr;
+            size_t sqesSize = 0;
+            unsigned* sqTail = nullptr;
+            unsigned sqMask = 0;
+            unsigned* sqArray = nullptr;
+            unsigned* cqHead = nullptr;
+            unsigned* cqTail = nullptr;
+            unsigned cqMask = 0;
+            io_uring_cqe* cqes = nullptr;
+
+            bool Open(unsigned entries) {
+                io_uring_params params{};
+                fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+                if (fd < 0) return false;
+
+                sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+                if (single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+                sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                cqRing = single ? sqRing : ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+                void* sqesMapping = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+                if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqesMapping == MAP_FAILED) {
+                    if (sqRing == MAP_FAILED) sqRing = nullptr;
+                    if (cqRing == MAP_FAILED) cqRing = nullptr;
+                    if (sqesMapping != MAP_FAILED) ::munmap(sqesMapping, sqesSize);
+                    Close();
+                    return false;
+                }
+
+                auto* sq = static_cast<std::byte*>(sqRing);
+                auto* cq = static_cast<std::byte*>(cqRing);
+                sqes = static_cast<io_uring_sqe*>(sqesMapping);
+                sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+                cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+                return true;
+            }
+
+            void Close() {
+                if (sqes) ::munmap(sqes, sqesSize);
+                if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+                if (sqRing) ::munmap(sqRing, sqRingSize);
+                if (fd >= 0) ::close(fd);
+                sqes = nullptr;
+                sqRing = cqRing = nullptr;
+                fd = -1;
+            }
+        };
+
+        // Caller holds mutex_. Returns 0, or the errno of io_uring_enter after withdrawing the entry.
+        int PushSqe(uint8_t opcode, int fd, uint64_t offset, iovec* io, uint64_t userData) {
+            unsigned tail = *ring_.sqTail;
+            unsigned index = tail & ring_.sqMask;
+            io_uring_sqe& sqe = ring_.sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<uint64_t>(io);
+            sqe.len = io ? 1 : 0;
+            sqe.user_data = userData;
+            ring_.sqArray[index] = index;
+            __atomic_store_n(ring_.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            int submitted;
+            do {
+                submitted = static_cast<int>(::syscall(__NR_io_uring_enter, ring_.fd, 1, 0, 0, nullptr, 0));
+            } while (submitted < 0 && errno == EINTR);
+            if (submitted == 1) return 0;
+
+            // Without SQPOLL the kernel only reads the queue inside io_uring_enter, so the entry is still ours
+            int error = submitted < 0 ? errno : EAGAIN;
+            __atomic_store_n(ring_.sqTail, tail, __ATOMIC_RELEASE);
+            return error;
+        }
+
+        void RunRing() {
+            size_t count = 0;
+            while (true) {
+                int result = static_cast<int>(::syscall(__NR_io_uring_enter, ring_.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (result < 0 && errno != EINTR) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    deliveryStopped_ = true;
+                    break;
+                }
+
+                unsigned head = *ring_.cqHead;
+                unsigned tail = __atomic_load_n(ring_.cqTail, __ATOMIC_ACQUIRE);
+                for (; head != tail; ++head) {
+                    const io_uring_cqe& cqe = ring_.cqes[head & ring_.cqMask];
+                    if (cqe.user_data == kWakeup) continue;
+                    if (Finish(static_cast<uint32_t>(cqe.user_data), cqe.res, count)) Deliver(count);
+                }
+                __atomic_store_n(ring_.cqHead, head, __ATOMIC_RELEASE);
+                Deliver(count);
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopping_ && inFlight_ == 0) break;
+            }
+            DetachDelivery();
+        }
+
+        Ring ring_;
+#endif
+
+        Options options_;
+        Handler handler_;
+
+        JavaVM* vm_ = nullptr;
+        GlobalRef<jobject> target_;
+        jmethodID method_ = nullptr;
+        JNIEnv* deliveryEnv_ = nullptr;
+        jobject deliveryBuffer_ = nullptr;
+
+        mutable std::mutex mutex_;
+        std::condition_variable pendingReady_;
+        std::condition_variable completedReady_;
+        std::vector<Slot> slots_;
+        std::vector<uint32_t> free_;
+        std::deque<uint32_t> pending_;
+        std::deque<std::pair<uint32_t, int32_t>> completedQueue_;
+        std::vector<Completion> batch_;
+        std::vector<jobject> pinned_; // Buffer references of finished reads, released after delivery
+        std::vector<std::thread> workers_;
+        std::thread delivery_;
+        bool stopping_ = false;
+        bool deliveryStopped_ = false;
+
+        size_t inFlight_ = 0;
+        uint64_t submitted_ = 0;
+        uint64_t completed_ = 0;
+        uint64_t batches_ = 0;
+        uint64_t undelivered_ = 0;
+        uint64_t totalLatencyNs_ = 0;
+        uint64_t maxLatencyNs_ = 0;
+    };
+
+    // Stores Java objects in slots of a few large Object[] segments, each held by one global reference.
+    // Native code keeps compact integer handles instead of global references, so storing and erasing
+    // objects never touches the VM's global reference table lock. Slots come from a lock-free free list.
+    class ObjectSlotTable {
+    public:
+        using Handle = uint32_t;
+        static constexpr Handle kInvalidHandle = detail::IndexFreeList::kNone;
+
+        ObjectSlotTable(JNIEnv* env, uint32_t segmentSize = 4096, uint32_t maxSegments = 256)
+                : segmentSize_(std::max<uint32_t>(segmentSize, 1)),
+                  maxSegments_(std::max<uint32_t>(maxSegments, 1)),
+                  arrays_(std::make_unique<std::atomic<jobjectArray>[]>(maxSegments_)),
+                  links_(std::make_unique<std::atomic<std::atomic<uint32_t>*>[]>(maxSegments_)),
+                  inUse_(std::make_unique<std::atomic<std::atomic<bool>*>[]>(maxSegments_)) {
+            if (static_cast<uint64_t>(segmentSize_) * maxSegments_ >= kInvalidHandle) throw JNIException("ObjectSlotTable too large");
+
+            jclass objectClass = FindClass(env, "java/lang/Object");
+            objectClass_ = GlobalRef<jclass>(env, objectClass);
+            env->DeleteLocalRef(objectClass);
+            segments_.reserve(maxSegments_);
+            AddSegment(env);
+        }
+
+        // Disable copy
+        ObjectSlotTable(const ObjectSlotTable&) = delete;
+        ObjectSlotTable& operator=(const ObjectSlotTable&) = delete;
+
+        Handle Store(JNIEnv* env, jobject obj) {
+            Handle handle = free_.pop(Links{this});
+            while (handle == kInvalidHandle) {
+                std::lock_guard<std::mutex> lock(growMutex_);
+                handle = free_.pop(Links{this});
+                if (handle == kInvalidHandle) AddSegment(env);
+            }
+
+            try {
+                Set(env, handle, obj);
+            } catch (...) {
+                free_.push(Links{this}, handle);
+                throw;
+            }
+            InUse(handle).store(true, std::memory_order_relaxed);
+            used_.fetch_add(1, std::memory_order_relaxed);
+            return handle;
+        }
+
+        // New local reference to the stored object
+        ScopedLocalRef<jobject> Load(JNIEnv* env, Handle handle) const {
+            jobject result = env->GetObjectArrayElement(Segment(handle), static_cast<jsize>(handle % segmentSize_));
+            JNI_CHECK_EXCEPTION(env);
+            return ScopedLocalRef<jobject>(env, result);
+        }
+
+        void Replace(JNIEnv* env, Handle handle, jobject obj) { Set(env, handle, obj); }
+
+        // Clear the slot, letting the object be collected, and recycle the handle.
+        // Returns false if the handle was already erased.
+        bool Erase(JNIEnv* env, Handle handle) {
+            Segment(handle);
+            if (!InUse(handle).exchange(false, std::memory_order_relaxed)) return false;
+
+            try {
+                Set(env, handle, nullptr);
+            } catch (...) {
+                InUse(handle).store(true, std::memory_order_relaxed);
+                throw;
+            }
+            free_.push(Links{this}, handle);
+            used_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        size_t size() const { return used_.load(std::memory_order_relaxed); }
+        size_t capacity() const { return static_cast<size_t>(segmentCount_.load(std::memory_order_acquire)) * segmentSize_; }
+
+    private:
+        // Free list links, stored per segment next to the Java arrays
+        struct Links {
+            ObjectSlotTable* table;
+            std::atomic<uint32_t>& operator()(uint32_t index) const {
+                return table->links_[index / table->segmentSize_].load(std::memory_order_acquire)[index % table->segmentSize_];
+            }
+        };
+
+        // Caller has validated the handle through Segment
+        std::atomic<bool>& InUse(Handle handle) const {
+            return inUse_[handle / segmentSize_].load(std::memory_order_acquire)[handle % segmentSize_];
+        }
+
+        jobjectArray Segment(Handle handle) const {
+            uint32_t segment = handle / segmentSize_;
+            if (handle == kInvalidHandle || segment >= segmentCount_.load(std::memory_order_acquire)) {
+                throw JNIException("Invalid ObjectSlotTable handle");
+            }
+            return arrays_[segment].load(std::memory_order_acquire);
+        }
+
+        void Set(JNIEnv* env, Handle handle, jobject obj) {
+            env->SetObjectArrayElement(Segment(handle), static_cast<jsize>(handle % segmentSize_), obj);
+            JNI_CHECK_EXCEPTION(env);
+        }
+
+        // Caller holds growMutex_ (or is the constructor)
+        void AddSegment(JNIEnv* env) {
+            uint32_t segment = segmentCount_.load(std::memory_order_relaxed);
+            if (segment == maxSegments_) throw JNIException("ObjectSlotTable is full");
+
+            jobjectArray array = env->NewObjectArray(static_cast<jsize>(segmentSize_), objectClass_.get(), nullptr);
+            JNI_CHECK_EXCEPTION(env);
+            segments_.emplace_back(env, array);
+            env->DeleteLocalRef(array);
+            linkStorage_.push_back(std::make_unique<std::atomic<uint32_t>[]>(segmentSize_));
+            inUseStorage_.push_back(std::make_unique<std::atomic<bool>[]>(segmentSize_));
+
+            arrays_[segment].store(segments_.back().get(), std::memory_order_release);
+            links_[segment].store(linkStorage_.back().get(), std::memory_order_release);
+            inUse_[segment].store(inUseStorage_.back().get(), std::memory_order_release);
+            segmentCount_.store(segment + 1, std::memory_order_release);
+
+            uint32_t first = segment * segmentSize_;
+            for (uint32_t i = segmentSize_; i-- > 0;) free_.push(Links{this}, first + i);
+        }
+
+        uint32_t segmentSize_;
+        uint32_t maxSegments_;
+        GlobalRef<jclass> objectClass_;
+        std::vector<GlobalRef<jobjectArray>> segments_;
+        std::vector<std::unique_ptr<std::atomic<uint32_t>[]>> linkStorage_;
+        std::unique_ptr<std::atomic<jobjectArray>[]> arrays_;
+        std::unique_ptr<std::atomic<std::atomic<uint32_t>*>[]> links_;
+        std::vector<std::unique_ptr<std::atomic<bool>[]>> inUseStorage_;
+        std::unique_ptr<std::atomic<std::atomic<bool>*>[]> inUse_;
+        std::atomic<uint32_t> segmentCount_{0};
+        std::atomic<size_t> used_{0};
+        detail::IndexFreeList free_;
+        std::mutex growMutex_;
+    };
+
+    // Hands Java objects from JNI callback threads to native worker threads in batches.
+    // A batch is copied into one Object[] promoted by a single NewGlobalRef, and released with a single
+    // DeleteGlobalRef once consumed, instead of one global reference per object.
+    class ObjectHandoffQueue {
+    public:
+        class Batch {
+        public:
+            Batch() = default;
+            Batch(GlobalRef<jobjectArray> array, size_t size) : array_(std::move(array)), size_(size) {}
+
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            jobjectArray array() const { return array_.get(); }
+
+            // New local reference to one element
+            ScopedLocalRef<jobject> Get(JNIEnv* env, size_t index) const {
+                jobject result = env->GetObjectArrayElement(array_.get(), static_cast<jsize>(index));
+                JNI_CHECK_EXCEPTION(env);
+                return ScopedLocalRef<jobject>(env, result);
+            }
+
+            // Call fn(env, jobject) for every element, deleting each local reference afterwards
+            template <typename Fn>
+            void ForEach(JNIEnv* env, Fn&& fn) const {
+                for (size_t i = 0; i < size_; ++i) {
+                    ScopedLocalRef<jobject> element = Get(env, i);
+                    fn(env, element.get());
+                }
+            }
+
+            // Drop the batch with the consumer's env instead of through the cached JavaVM
+            void Release(JNIEnv* env) {
+                array_.reset(env);
+                size_ = 0;
+            }
+
+        private:
+            GlobalRef<jobjectArray> array_;
+            size_t size_ = 0;
+        };
+
+        // maxBatches = 0 leaves the queue unbounded, otherwise Push blocks while it is full
+        explicit ObjectHandoffQueue(size_t maxBatches = 0) : maxBatches_(maxBatches) {}
+
+        // Disable copy
+        ObjectHandoffQueue(const ObjectHandoffQueue&) = delete;
+        ObjectHandoffQueue& operator=(const ObjectHandoffQueue&) = delete;
+
+        // Promote count objects as one batch, returns false if the queue was closed
+        bool Push(JNIEnv* env, const jobject* objects, size_t count) {
+            if (count == 0) return true;
+
+            jclass objectClass = FindClass(env, "java/lang/Object");
+            ScopedLocalRef<jclass> objectClassRef(env, objectClass);
+            ScopedLocalRef<jobjectArray> array(env, env->NewObjectArray(static_cast<jsize>(count), objectClass, nullptr));
+            JNI_CHECK_EXCEPTION(env);
+
+            for (size_t i = 0; i < count; ++i) {
+                env->SetObjectArrayElement(array.get(), static_cast<jsize>(i), objects[i]);
+                JNI_CHECK_EXCEPTION(env);
+            }
+
+            Batch batch(GlobalRef<jobjectArray>(env, array.get()), count);
+            std::unique_lock<std::mutex> lock(mutex_);
+            notFull_.wait(lock, [this] { return closed_ || maxBatches_ == 0 || batches_.size() < maxBatches_; });
+            if (closed_) return false;
+
+            batches_.push_back(std::move(batch));
+            pushedObjects_ += count;
+            lock.unlock();
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        bool Push(JNIEnv* env, const LocalRefVector<jobject>& objects) {
+            std::vector<jobject> refs(objects.begin(), objects.end());
+            return Push(env, refs.data(), refs.size());
+        }
+
+        // Block until a batch is available, false once the queue is closed and drained
+        bool Pop(Batch& batch) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return closed_ || !batches_.empty(); });
+            if (batches_.empty()) return false;
+
+            batch = std::move(batches_.front());
+            batches_.pop_front();
+            lock.unlock();
+            notFull_.notify_one();
+            return true;
+        }
+
+        bool TryPop(Batch& batch) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (batches_.empty()) return false;
+
+            batch = std::move(batches_.front());
+            batches_.pop_front();
+            lock.unlock();
+            notFull_.notify_one();
+            return true;
+        }
+
+        // Wake every waiter, remaining batches can still be popped
+        void Close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            notEmpty_.notify_all();
+            notFull_.notify_all();
+        }
+
+        size_t pendingBatches() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return batches_.size();
+        }
+
+        uint64_t pushedObjects() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return pushedObjects_;
+        }
+
+    private:
+        size_t maxBatches_;
+        mutable std::mutex mutex_;
+        std::condition_variable notEmpty_;
+        std::condition_variable notFull_;
+        std::deque<Batch> batches_;
+        uint64_t pushedObjects_ = 0;
+        bool closed_ = false;
+    };
+
+    // JNIException whose jthrowable is a global reference shared by every copy, so it stays valid on
+    // whichever thread the exception is rethrown
+    class JNIGlobalException : public JNIException {
+    public:
+        JNIGlobalException(const char* message, SharedGlobalRef<jthrowable> throwable)
+                : JNIException(message, throwable.get()), throwable_(std::move(throwable)) {}
+
+    private:
+        SharedGlobalRef<jthrowable> throwable_;
+    };
+
+    namespace detail {
+        // The jthrowable of a JNIException is a local reference; promote it while it is still valid
+        // so the exception can be rethrown on another thread or outside the current local frame
+        inline std::exception_ptr PromoteException(JNIEnv* env, const JNIException& exception) {
+            jthrowable throwable = exception.getJavaException();
+            if (!throwable) return std::make_exception_ptr(JNIException(exception.what()));
+            return std::make_exception_ptr(JNIGlobalException(exception.what(), SharedGlobalRef<jthrowable>(env, throwable)));
+        }
+    } // namespace detail
+
+    // Fixed pool of native threads attached to the JVM once, with one deque per worker and work stealing.
+    // Workers pop their own deque newest first and steal the oldest task of another worker when idle.
+    // Every task runs inside a fresh local frame, and Java exceptions left pending are cleared before the next one.
+    class JNIThreadPool {
+    public:
+        using Task = std::function<void(JNIEnv*)>;
+
+        struct Options {
+            size_t threads = 0;                    // 0 uses std::thread::hardware_concurrency()
+            std::string namePrefix = "jni-worker"; // Java thread names are namePrefix-<index>
+            bool daemon = true;
+            std::vector<int> cpuAffinity;          // Worker i is pinned to cpuAffinity[i % size], empty leaves them free
+            jint frameCapacity = 32;               // Local references each task may create without EnsureLocalCapacity
+            std::function<void(std::exception_ptr)> onError; // Receives exceptions escaping a task or a failed attach
+        };
+
+        struct Stats {
+            size_t threads;
+            size_t queued;
+            std::vector<size_t> queueDepths; // Per worker
+            uint64_t submitted;
+            uint64_t executed;
+            uint64_t stolen;
+            uint64_t failed;                 // Tasks that threw or left a Java exception pending
+        };
+
+        JNIThreadPool() : JNIThreadPool(Options()) {}
+
+        explicit JNIThreadPool(Options options) : options_(std::move(options)) {
+            if (!GetJavaVM()) throw JNIException("JavaVM not set, call jni::SetJavaVM from JNI_OnLoad");
+
+            size_t count = options_.threads ? options_.threads : std::max(1u, std::thread::hardware_concurrency());
+            for (size_t i = 0; i < count; ++i) workers_.push_back(std::make_unique<Worker>());
+            try {
+                for (size_t i = 0; i < count; ++i) workers_[i]->thread = std::thread([this, i] { Run(i); });
+            } catch (...) {
+                // The workers already started must be joined before their std::thread objects go away
+                Stop();
+                throw;
+            }
+        }
+
+        // Runs every queued task, then detaches and joins the workers
+        ~JNIThreadPool() { Stop(); }
+
+        // Disable copy
+        JNIThreadPool(const JNIThreadPool&) = delete;
+        JNIThreadPool& operator=(const JNIThreadPool&) = delete;
+
+        // Shared pool used by the parallel helpers. Never destroyed, its workers may outlive static destructors.
+        static JNIThreadPool& Default() {
+            static JNIThreadPool* pool = new JNIThreadPool();
+            return *pool;
+        }
+
+        // Queue a task, on the calling worker's own deque when called from inside the pool
+        void Submit(Task task) {
+            size_t index = CurrentOwner() == this ? static_cast<size_t>(CurrentIndex())
+                                                 : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+            // Counted before it is visible, a worker that pops it at once must not take queued_ below zero
+            queued_.fetch_add(1, std::memory_order_release);
+            try {
+                std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+                workers_[index]->tasks.push_back(std::move(task));
+            } catch (...) {
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                throw;
+            }
+            submitted_.fetch_add(1, std::memory_order_relaxed);
+
+            // Lock before notifying so a worker between its check and its wait cannot miss the task
+            { std::lock_guard<std::mutex> lock(sleepMutex_); }
+            wakeup_.notify_one();
+        }
+
+        size_t size() const { return workers_.size(); }
+
+        // Index of the calling worker in its pool, -1 outside any pool
+        static int CurrentWorker() { return CurrentOwner() ? CurrentIndex() : -1; }
+
+        Stats stats() const {
+            Stats stats{};
+            stats.threads = workers_.size();
+            stats.queued = queued_.load(std::memory_order_relaxed);
+            for (const auto& worker : workers_) {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                stats.queueDepths.push_back(worker->tasks.size());
+            }
+            stats.submitted = submitted_.load(std::memory_order_relaxed);
+            stats.executed = executed_.load(std::memory_order_relaxed);
+            stats.stolen = stolen_.load(std::memory_order_relaxed);
+            stats.failed = failed_.load(std::memory_order_relaxed);
+            return stats;
+        }
+
+    private:
+        struct Worker {
+            mutable std::mutex mutex;
+            std::deque<Task> tasks;
+            std::thread thread;
+        };
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex_);
+                stopping_ = true;
+            }
+            wakeup_.notify_all();
+            for (auto& worker : workers_) {
+                if (worker->thread.joinable()) worker->thread.join();
+            }
+        }
+
+        static JNIThreadPool*& CurrentOwner() {
+            thread_local JNIThreadPool* owner = nullptr;
+            return owner;
+        }
+
+        static int& CurrentIndex() {
+            thread_local int index = -1;
+            return index;
+        }
+
+        // Nothing may escape a worker thread. A worker that cannot attach reports it and exits,
+        // the remaining workers steal whatever lands on its deque.
+        void Run(size_t index) {
+            CurrentOwner() = this;
+            CurrentIndex() = static_cast<int>(index);
+            if (!options_.cpuAffinity.empty()) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(options_.cpuAffinity[index % options_.cpuAffinity.size()], &cpus);
+                sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+
+            try {
+                std::string name = options_.namePrefix + "-" + std::to_string(index);
+                JNIEnv* env = Env({name.c_str(), options_.daemon, nullptr});
+
+                Task task;
+                while (true) {
+                    if (PopOwn(index, task) || Steal(index, task)) {
+                        Execute(env, task);
+                        task = nullptr;
+                        continue;
+                    }
+
+                    std::unique_lock<std::mutex> lock(sleepMutex_);
+                    wakeup_.wait(lock, [this] { return stopping_ || queued_.load(std::memory_order_acquire) > 0; });
+                    if (stopping_ && queued_.load(std::memory_order_acquire) == 0) break;
+                }
+            } catch (...) {
+                ReportError(std::current_exception());
+            }
+
+            DetachCurrentThread();
+            CurrentOwner() = nullptr;
+        }
+
+        // A throwing onError is swallowed, it must not take the worker down
+        void ReportError(std::exception_ptr error) noexcept {
+            if (!options_.onError) return;
+            try {
+                options_.onError(error);
+            } catch (...) {
+            }
+        }
+
+        bool PopOwn(size_t index, Task& task) {
+            Worker& worker = *workers_[index];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.tasks.empty()) return false;
+
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool Steal(size_t thief, Task& task) {
+            for (size_t offset = 1; offset < workers_.size(); ++offset) {
+                Worker& victim = *workers_[(thief + offset) % workers_.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.tasks.empty()) continue;
+
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                stolen_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+
+        void Execute(JNIEnv* env, Task& task) {
+            bool failed = false;
+            try {
+                LocalFrame frame(env, options_.frameCapacity);
+                try {
+                    task(env);
+                } catch (const JNIException& e) {
+                    // The throwable is a local reference in frame, promote it before the frame is popped
+                    std::rethrow_exception(detail::PromoteException(env, e));
+                }
+            } catch (...) {
+                failed = true;
+                ReportError(std::current_exception());
+            }
+
+            if (env->ExceptionCheck()) {
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+                failed = true;
+            }
+            if (failed) failed_.fetch_add(1, std::memory_order_relaxed);
+            executed_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        Options options_;
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::mutex sleepMutex_;
+        std::condition_variable wakeup_;
+        bool stopping_ = false;
+        std::atomic<size_t> queued_{0};
+        std::atomic<size_t> next_{0};
+        std::atomic<uint64_t> submitted_{0};
+        std::atomic<uint64_t> executed_{0};
+        std::atomic<uint64_t> stolen_{0};
+        std::atomic<uint64_t> failed_{0};
+    };
+
+    struct ParallelOptions {
+        JNIThreadPool* pool = nullptr; // JNIThreadPool::Default() when null
+        size_t grainSize = 0;          // Elements per chunk, 0 picks about four chunks per thread
+        jint refsPerElement = 1;       // Local references fn creates per element, sizes the local frames
+    };
+
+    namespace detail {
+        // The Object[] itself, or collection.toArray() for any java.util.Collection
+        inline ScopedLocalRef<jobjectArray> ToObjectArray(JNIEnv* env, jobject source) {
+            ScopedLocalRef<jclass> arrayClass = ClassIdCache::Instance().GetClass(env, "[Ljava/lang/Object;");
+            if (env->IsInstanceOf(source, arrayClass.get())) {
+                return ScopedLocalRef<jobjectArray>(env, static_cast<jobjectArray>(env->NewLocalRef(source)));
+            }
+
+            static CachedMethodID toArray("java/util/Collection", "toArray", "()[Ljava/lang/Object;");
+            jobject array = env->CallObjectMethod(source, toArray.get(env));
+            JNI_CHECK_EXCEPTION(env);
+            return ScopedLocalRef<jobjectArray>(env, static_cast<jobjectArray>(array));
+        }
+
+        // Chunks are claimed from one counter by the calling thread and by helper tasks on the pool,
+        // so the caller always makes progress even when it is itself a pool worker
+        template <typename T, typename Fn>
+        struct ParallelReduction {
+            GlobalRef<jobjectArray> array;
+            size_t length = 0;
+            size_t grain = 1;
+            size_t chunks = 0;
+            jint refsPerElement = 1;
+            Fn* fn = nullptr;
+            std::vector<T> partials;
+
+            std::atomic<size_t> nextChunk{0};
+            std::atomic<bool> failed{false};
+            std::mutex mutex;
+            std::condition_variable finishedAll;
+            size_t finished = 0;
+            std::exception_ptr error;
+
+            void Drain(JNIEnv* env) {
+                for (size_t chunk; (chunk = nextChunk.fetch_add(1, std::memory_order_relaxed)) < chunks;) {
+                    if (!failed.load(std::memory_order_relaxed)) {
+                        try {
+                            Process(env, chunk);
+                        } catch (...) {
+                            Fail(std::current_exception());
+                        }
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (++finished == chunks) finishedAll.notify_all();
+                }
+            }
+
+            void Process(JNIEnv* env, size_t chunk) {
+                size_t begin = chunk * grain;
+                size_t end = std::min(length, begin + grain);
+                T partial = std::move(partials[chunk]);
+
+                // Every element and whatever fn created for it is released when the frame rolls over
+                ChunkedLocalFrames frames(env, 256, refsPerElement + 1);
+                try {
+                    for (size_t i = begin; i < end; ++i) {
+                        jobject element = env->GetObjectArrayElement(array.get(), static_cast<jsize>(i));
+                        JNI_CHECK_EXCEPTION(env);
+                        (*fn)(env, element, i, partial);
+                        frames.next(refsPerElement + 1);
+                    }
+                } catch (const JNIException& e) {
+                    // Before the frame holding the jthrowable is popped
+                    std::rethrow_exception(PromoteException(env, e));
+                }
+                partials[chunk] = std::move(partial);
+            }
+
+            void Fail(std::exception_ptr exception) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = exception;
+                failed.store(true, std::memory_order_relaxed);
+            }
+        };
+    } // namespace detail
+
+    // Run fn(env, element, index, partial) over an Object[] or java.util.Collection on the pool and the
+    // calling thread, then fold the per-chunk partials in index order with reduce(T, T).
+    // fn runs concurrently on several threads, each with its own env; the array is shared through one
+    // global reference. The first exception stops further chunks and is rethrown here.
+    template <typename T, typename Fn, typename Reduce>
+    T ParallelReduce(JNIEnv* env, jobject source, T identity, Fn&& fn, Reduce&& reduce,
+                     const ParallelOptions& options = {}) {
+        ScopedLocalRef<jobjectArray> local = detail::ToObjectArray(env, source);
+        size_t length = local ? static_cast<size_t>(env->GetArrayLength(local.get())) : 0;
+        if (length == 0) return identity;
+
+        JNIThreadPool& pool = options.pool ? *options.pool : JNIThreadPool::Default();
+        size_t threads = pool.size() + 1;
+
+        using Fun = std::remove_reference_t<Fn>;
+        auto state = std::make_shared<detail::ParallelReduction<T, Fun>>();
+        state->array = GlobalRef<jobjectArray>(env, local.get());
+        state->length = length;
+        state->grain = options.grainSize ? options.grainSize : std::max<size_t>(256, (length + threads * 4 - 1) / (threads * 4));
+        state->chunks = (length + state->grain - 1) / state->grain;
+        state->refsPerElement = std::max<jint>(options.refsPerElement, 0);
+        state->fn = &fn;
+        state->partials.assign(state->chunks, identity);
+
+        size_t helpers = std::min(pool.size(), state->chunks - 1);
+        for (size_t i = 0; i < helpers; ++i) {
+            pool.Submit([state](JNIEnv* workerEnv) { state->Drain(workerEnv); });
+        }
+        state->Drain(env);
+
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->finishedAll.wait(lock, [&state] { return state->finished == state->chunks; });
+        }
+        state->array.reset(env);
+        if (state->error) std::rethrow_exception(state->error);
+
+        T result = std::move(identity);
+        for (T& partial : state->partials) result = reduce(std::move(result), std::move(partial));
+        return result;
+    }
+
+    // Run fn(env, element, index) over an Object[] or java.util.Collection, see ParallelReduce
+    template <typename Fn>
+    void ParallelForEach(JNIEnv* env, jobject source, Fn&& fn, const ParallelOptions& options = {}) {
+        auto visit = [&fn](JNIEnv* workerEnv, jobject element, size_t index, char&) { fn(workerEnv, element, index); };
+        ParallelReduce(env, source, char(0), visit, [](char, char) { return char(0); }, options);
+    }
+
+    template <typename T> class JavaPromise;
+
+    // Shareable handle to a result produced on another thread. Continuations added with then() run on the
+    // completing thread, or immediately if the result is already there, and receive the ready future.
+    template <typename T>
+    class JavaFuture {
+    public:
+        JavaFuture() = default;
+
+        bool valid() const { return state_ != nullptr; }
+
+        bool ready() const {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            return state_->done;
+        }
+
+        void wait() const {
+            std::unique_lock<std::mutex> lock(state_->mutex);
+            state_->readyCondition.wait(lock, [this] { return state_->done; });
+        }
+
+        template <typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout) const {
+            std::unique_lock<std::mutex> lock(state_->mutex);
+            return state_->readyCondition.wait_for(lock, timeout, [this] { return state_->done; });
+        }
+
+        // Wait, then return the value or rethrow the exception; object results are GlobalRefs that can be moved out
+        decltype(auto) get() const {
+            wait();
+            if (state_->error) std::rethrow_exception(state_->error);
+            if constexpr (!std::is_void_v<T>) return static_cast<T&>(*state_->value);
+        }
+
+        template <typename Fn>
+        auto then(Fn&& fn) const {
+            using U = std::invoke_result_t<Fn&, JavaFuture<T>&>;
+            JavaPromise<U> promise;
+            JavaFuture<U> next = promise.future();
+
+            AddContinuation([self = *this, promise, fn = std::forward<Fn>(fn)]() mutable {
+                try {
+                    if constexpr (std::is_void_v<U>) {
+                        fn(self);
+                        promise.SetValue();
+                    } else {
+                        promise.SetValue(fn(self));
+                    }
+                } catch (...) {
+                    promise.SetException(std::current_exception());
+                }
+            });
+            return next;
+        }
+
+#if JNI_HELPER_HAS_COROUTINES
+        // co_await resumes the coroutine on the completing thread and yields the value, moved out of the future
+        auto operator co_await() const {
+            struct Awaiter {
+                JavaFuture future;
+
+                bool await_ready() const { return future.ready(); }
+
+                // Completed since await_ready: do not suspend, so the coroutine is only ever resumed by another thread
+                bool await_suspend(std::coroutine_handle<> handle) const {
+                    std::function<void()> resume = [handle] { handle.resume(); };
+                    return future.TryAddContinuation(resume);
+                }
+
+                auto await_resume() const {
+                    if constexpr (std::is_void_v<T>) {
+                        future.get();
+                    } else {
+                        return T(std::move(future.get()));
+                    }
+                }
+            };
+            return Awaiter{*this};
+        }
+#endif
+
+    private:
+        friend class JavaPromise<T>;
+
+        struct State {
+            std::mutex mutex;
+            std::condition_variable readyCondition;
+            bool done = false;
+            std::optional<std::conditional_t<std::is_void_v<T>, char, T>> value;
+            std::exception_ptr error;
+            std::vector<std::function<void()>> continuations;
+        };
+
+        explicit JavaFuture(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+        // Queue continuation unless the future is done already, then it is left with the caller and false returned
+        bool TryAddContinuation(std::function<void()>& continuation) const {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            if (state_->done) return false;
+            state_->continuations.push_back(std::move(continuation));
+            return true;
+        }
+
+        void AddContinuation(std::function<void()> continuation) const {
+            if (!TryAddContinuation(continuation)) continuation();
+        }
+
+        std::shared_ptr<State> state_;
+    };
+
+    template <typename T>
+    class JavaPromise {
+    public:
+        JavaPromise() : state_(std::make_shared<State>()) {}
+
+        JavaFuture<T> future() const { return JavaFuture<T>(state_); }
+
+        template <typename... Value>
+        void SetValue(Value&&... value) {
+            Complete([&](State& state) { state.value.emplace(std::forward<Value>(value)...); });
+        }
+
+        void SetException(std::exception_ptr error) {
+            Complete([&](State& state) { state.error = std::move(error); });
+        }
+
+    private:
+        using State = typename JavaFuture<T>::State;
+
+        template <typename Fn>
+        void Complete(Fn&& store) {
+            std::vector<std::function<void()>> continuations;
+            {
+                std::lock_guard<std::mutex> lock(state_->mutex);
+                if (state_->done) return;
+                store(*state_);
+                state_->done = true;
+                continuations.swap(state_->continuations);
+            }
+            state_->readyCondition.notify_all();
+            for (auto& continuation : continuations) continuation();
+        }
+
+        std::shared_ptr<State> state_;
+    };
+
+    namespace detail {
+        // Arguments captured for a call on another thread: references become shared global references,
+        // strings are copied, primitives travel by value
+        template <typename T, typename = void>
+        struct AsyncArg {
+            static_assert(!std::is_pointer_v<T>, "Only Java references and C strings can cross threads as pointers");
+            using Stored = T;
+            static Stored Capture(JNIEnv*, T value) { return value; }
+            static T Use(const Stored& stored) { return stored; }
+        };
+
+        template <typename T>
+        struct AsyncArg<T, std::enable_if_t<std::is_convertible_v<T, jobject> && !std::is_same_v<T, std::nullptr_t>>> {
+            using Stored = SharedGlobalRef<T>;
+            static Stored Capture(JNIEnv* env, T value) { return Stored(env, value); }
+            static T Use(const Stored& stored) { return stored.get(); }
+        };
+
+        template <>
+        struct AsyncArg<std::string> {
+            using Stored = std::string;
+            static Stored Capture(JNIEnv*, const std::string& value) { return value; }
+            static const std::string& Use(const Stored& stored) { return stored; }
+        };
+
+        template <>
+        struct AsyncArg<const char*> {
+            using Stored = std::pair<bool, std::string>;
+            static Stored Capture(JNIEnv*, const char* value) { return {value != nullptr, value ? value : ""}; }
+            static const char* Use(const Stored& stored) { return stored.first ? stored.second.c_str() : nullptr; }
+        };
+
+        template <>
+        struct AsyncArg<char*> : AsyncArg<const char*> {};
+
+        // Object results come back as global references
+        template <typename T>
+        using AsyncValue = std::conditional_t<std::is_convertible_v<T, jobject>, GlobalRef<T>, T>;
+
+        template <typename RetType, typename Call>
+        void CompleteAsync(JNIEnv* env, JavaPromise<AsyncValue<RetType>>& promise, Call&& call) {
+            try {
+                if constexpr (std::is_void_v<RetType>) {
+                    call();
+                    promise.SetValue();
+                } else if constexpr (std::is_convertible_v<RetType, jobject>) {
+                    ScopedLocalRef<RetType> result(env, call());
+                    promise.SetValue(GlobalRef<RetType>(env, result.get()));
+                } else {
+                    promise.SetValue(call());
+                }
+            } catch (const JNIException& e) {
+                promise.SetException(PromoteException(env, e));
+            } catch (...) {
+                promise.SetException(std::current_exception());
+            }
+        }
+    } // namespace detail
+
+    // Run obj.methodName(args...) on a pool worker. Reference arguments are promoted to global references
+    // and strings copied, so locals may be deleted once this returns. Object results arrive as GlobalRef<T>,
+    // Java exceptions as JNIGlobalException.
+    template <typename RetType, typename... Args>
+    JavaFuture<detail::AsyncValue<RetType>> CallMethodAsync(JNIThreadPool& pool, JNIEnv* env, jobject obj, const char* methodName,
+                                                            const char* signature, Args... args) {
+        JavaPromise<detail::AsyncValue<RetType>> promise;
+        auto future = promise.future();
+
+        pool.Submit([promise, target = SharedGlobalRef<jobject>(env, obj), method = std::string(methodName),
+                     sig = std::string(signature),
+                     captured = std::make_tuple(detail::AsyncArg<Args>::Capture(env, args)...)](JNIEnv* workerEnv) mutable {
+            detail::CompleteAsync<RetType>(workerEnv, promise, [&]() -> RetType {
+                return std::apply([&](const auto&... stored) -> RetType {
+                    return CallMethod<RetType>(workerEnv, target.get(), method.c_str(), sig.c_str(), detail::AsyncArg<Args>::Use(stored)...);
+                }, captured);
+            });
+        });
+        return future;
+    }
+
+    template <typename RetType, typename... Args>
+    JavaFuture<detail::AsyncValue<RetType>> CallMethodAsync(JNIEnv* env, jobject obj, const char* methodName,
+                                                            const char* signature, Args... args) {
+        return CallMethodAsync<RetType>(JNIThreadPool::Default(), env, obj, methodName, signature, args...);
+    }
+
+    template <typename RetType, typename... Args>
+    JavaFuture<detail::AsyncValue<RetType>> CallStaticMethodAsync(JNIThreadPool& pool, JNIEnv* env, const char* className,
+                                                                  const char* methodName, const char* signature, Args... args) {
+        JavaPromise<detail::AsyncValue<RetType>> promise;
+        auto future = promise.future();
+
+        pool.Submit([promise, cls = std::string(className), method = std::string(methodName), sig = std::string(signature),
+                     captured = std::make_tuple(detail::AsyncArg<Args>::Capture(env, args)...)](JNIEnv* workerEnv) mutable {
+            detail::CompleteAsync<RetType>(workerEnv, promise, [&]() -> RetType {
+                return std::apply([&](const auto&... stored) -> RetType {
+                    return CallStaticMethod<RetType>(workerEnv, cls.c_str(), method.c_str(), sig.c_str(), detail::AsyncArg<Args>::Use(stored)...);
+                }, captured);
+            });
+        });
+        return future;
+    }
+
+    template <typename RetType, typename... Args>
+    JavaFuture<detail::AsyncValue<RetType>> CallStaticMethodAsync(JNIEnv* env, const char* className, const char* methodName,
+                                                                  const char* signature, Args... args) {
+        return CallStaticMethodAsync<RetType>(JNIThreadPool::Default(), env, className, methodName, signature, args...);
+    }
+
+    // Run fn(env) on a pool worker. Object results arrive as GlobalRef<T>; the future can be awaited.
+    template <typename Fn>
+    auto Offload(Fn fn, JNIThreadPool& pool = JNIThreadPool::Default()) {
+        using RetType = std::invoke_result_t<Fn&, JNIEnv*>;
+        JavaPromise<detail::AsyncValue<RetType>> promise;
+        auto future = promise.future();
+
+        pool.Submit([promise, fn = std::move(fn)](JNIEnv* workerEnv) mutable {
+            detail::CompleteAsync<RetType>(workerEnv, promise, [&]() -> RetType { return fn(workerEnv); });
+        });
+        return future;
+    }
+
+#if JNI_HELPER_HAS_COROUTINES
+    namespace detail {
+        // Size-class free lists for coroutine frames. Each thread keeps a few frames per class so most
+        // allocations take no lock, the overflow goes through one shared list per class.
+        class CoroutineFramePool {
+        public:
+            static constexpr size_t kMinFrame = 64;
+            static constexpr size_t kClasses = 7; // 64 to 4096 bytes
+            static constexpr size_t kThreadCache = 32;
+
+            static void* Allocate(size_t size) {
+                size_t index = ClassOf(size);
+                if (index == kClasses) return ::operator new(size);
+
+                std::vector<void*>& cached = Cache().frames[index];
+                if (!cached.empty()) {
+                    void* frame = cached.back();
+                    cached.pop_back();
+                    return frame;
+                }
+
+                Shared& shared = SharedLists();
+                {
+                    std::lock_guard<std::mutex> lock(shared.mutex[index]);
+                    if (!shared.frames[index].empty()) {
+                        void* frame = shared.frames[index].back();
+                        shared.frames[index].pop_back();
+                        return frame;
+                    }
+                }
+                return ::operator new(kMinFrame << index);
+            }
+
+            static void Free(void* frame, size_t size) noexcept {
+                size_t index = ClassOf(size);
+                if (index == kClasses) {
+                    ::operator delete(frame);
+                    return;
+                }
+
+                try {
+                    std::vector<void*>& cached = Cache().frames[index];
+                    if (cached.size() < kThreadCache) {
+                        cached.push_back(frame);
+                        return;
+                    }
+
+                    Shared& shared = SharedLists();
+                    std::lock_guard<std::mutex> lock(shared.mutex[index]);
+                    shared.frames[index].push_back(frame);
+                } catch (...) {
+                    ::operator delete(frame);
+                }
+            }
+
+        private:
+            struct Shared {
+                std::mutex mutex[kClasses];
+                std::vector<void*> frames[kClasses];
+            };
+
+            // Frames cached by a thread go back to the shared lists when it exits
+            struct ThreadCache {
+                std::vector<void*> frames[kClasses];
+
+                ~ThreadCache() {
+                    Shared& shared = SharedLists();
+                    for (size_t i = 0; i < kClasses; ++i) {
+                        std::lock_guard<std::mutex> lock(shared.mutex[i]);
+                        shared.frames[i].insert(shared.frames[i].end(), frames[i].begin(), frames[i].end());
+                    }
+                }
+            };
+
+            static size_t ClassOf(size_t size) {
+                size_t index = 0;
+                while (index < kClasses && (kMinFrame << index) < size) ++index;
+                return index;
+            }
+
+            // Never destroyed, pool workers may still free frames while static destructors run
+            static Shared& SharedLists() {
+                static Shared* shared = new Shared();
+                return *shared;
+            }
+
+            static ThreadCache& Cache() {
+                thread_local ThreadCache cache;
+                return cache;
+            }
+        };
+    } // namespace detail
+
+    // Base for promise types whose coroutine frames should come from the frame pool
+    struct PooledCoroutineFrame {
+        static void* operator new(size_t size) { return detail::CoroutineFramePool::Allocate(size); }
+        static void operator delete(void* frame, size_t size) noexcept { detail::CoroutineFramePool::Free(frame, size); }
+    };
+
+    namespace detail {
+        template <typename T>
+        struct AsyncTaskReturn {
+            JavaPromise<T> promise;
+
+            template <typename Value>
+            void return_value(Value&& value) { promise.SetValue(std::forward<Value>(value)); }
+        };
+
+        template <>
+        struct AsyncTaskReturn<void> {
+            JavaPromise<void> promise;
+
+            void return_void() { promise.SetValue(); }
+        };
+    } // namespace detail
+
+    // Eagerly started coroutine publishing its result through a JavaFuture, so callers can co_await it,
+    // chain it with then() or block in get(). Frames come from the coroutine frame pool.
+    template <typename T = void>
+    class AsyncTask {
+    public:
+        struct promise_type : PooledCoroutineFrame, detail::AsyncTaskReturn<T> {
+            AsyncTask get_return_object() { return AsyncTask(this->promise.future()); }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void unhandled_exception() { this->promise.SetException(std::current_exception()); }
+        };
+
+        JavaFuture<T> future() const { return future_; }
+        decltype(auto) get() const { return future_.get(); }
+        auto operator co_await() const { return future_.operator co_await(); }
+
+    private:
+        explicit AsyncTask(JavaFuture<T> future) : future_(std::move(future)) {}
+
+        JavaFuture<T> future_;
+    };
+
+    // co_await ResumeOnPool() continues the coroutine on a pool worker, where jni::Env() is attached
+    inline auto ResumeOnPool(JNIThreadPool& pool = JNIThreadPool::Default()) {
+        struct Awaiter {
+            JNIThreadPool& pool;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) const { pool.Submit([handle](JNIEnv*) { handle.resume(); }); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{pool};
+    }
+
+    namespace detail {
+        // Java class implementing BiConsumer whose accept() forwards to OnJavaCompletion, see RegisterCompletionCallback
+        struct CompletionCallback {
+            std::mutex mutex;
+            std::atomic<jclass> cls{nullptr}; // Global reference, lives for the whole process
+            jmethodID constructor = nullptr;
+            jmethodID whenComplete = nullptr;
+
+            static CompletionCallback& Instance() {
+                static CompletionCallback callback;
+                return callback;
+            }
+        };
+    } // namespace detail
+
+    // Suspends until a java.util.concurrent.CompletionStage completes, without parking a thread.
+    // One callback object is created per await and calls back into native code exactly once; the coroutine
+    // resumes on the thread completing the stage. The coroutine must not be destroyed while suspended here.
+    // The stage is held as a global reference, the awaiter may be awaited on another thread than it was created on.
+    class CompletionStageAwaiter {
+    public:
+        CompletionStageAwaiter(JNIEnv* env, jobject stage) : stage_(env, stage) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            auto& callback = detail::CompletionCallback::Instance();
+            jclass cls = callback.cls.load(std::memory_order_acquire);
+            if (!cls) throw JNIException("Completion callback not registered, call jni::RegisterCompletionCallback");
+
+            // The awaiting thread, attached if needed
+            JNIEnv* env = Env();
+            ScopedLocalRef<jobject> consumer(env, env->NewObject(cls, callback.constructor,
+                                                                 static_cast<jlong>(reinterpret_cast<intptr_t>(this))));
+            JNI_CHECK_EXCEPTION(env);
+            ScopedLocalRef<jobject> next(env, env->CallObjectMethod(stage_.get(), callback.whenComplete, consumer.get()));
+            JNI_CHECK_EXCEPTION(env);
+            stage_.reset(env);
+
+            // The stage may already have completed and called back on this thread, then resume right away
+            State expected = State::Registering;
+            return state_.compare_exchange_strong(expected, State::Suspended, std::memory_order_acq_rel);
+        }
+
+        // The stage's value as a global reference, or its Throwable as JNIGlobalException
+        GlobalRef<jobject> await_resume() {
+            if (error_) std::rethrow_exception(error_);
+            return std::move(value_);
+        }
+
+        // Called once by the Java callback
+        void Complete(JNIEnv* env, jobject value, jthrowable error) {
+            try {
+                if (error) {
+                    error_ = std::make_exception_ptr(JNIGlobalException("CompletionStage completed exceptionally",
+                                                                        SharedGlobalRef<jthrowable>(env, error)));
+                } else {
+                    value_ = GlobalRef<jobject>(env, value);
+                }
+            } catch (...) {
+                error_ = std::current_exception();
+            }
+            if (state_.exchange(State::Completed, std::memory_order_acq_rel) == State::Suspended) handle_.resume();
+        }
+
+    private:
+        enum class State { Registering, Suspended, Completed };
+
+        GlobalRef<jobject> stage_;
+        std::coroutine_handle<> handle_;
+        std::atomic<State> state_{State::Registering};
+        GlobalRef<jobject> value_;
+        std::exception_ptr error_;
+    };
+
+    // co_await jni::Await(env, completableFuture)
+    inline CompletionStageAwaiter Await(JNIEnv* env, jobject stage) { return CompletionStageAwaiter(env, stage); }
+
+    // Takes a local reference straight from a call and deletes it once the awaiter holds the stage globally,
+    // before the coroutine can suspend and resume on another thread
+    template <typename T>
+    CompletionStageAwaiter Await(JNIEnv* env, ScopedLocalRef<T> stage) { return CompletionStageAwaiter(env, stage.get()); }
+
+    namespace detail {
+        inline void JNICALL OnJavaCompletion(JNIEnv* env, jclass, jlong handle, jobject value, jthrowable error) {
+            reinterpret_cast<CompletionStageAwaiter*>(static_cast<intptr_t>(handle))->Complete(env, value, error);
+        }
+    } // namespace detail
+
+    // Bind the native half of the completion callback class, once per process.
+    // The class is generated by GenerateCompletionCallbackJava and shipped with the application.
+    inline void RegisterCompletionCallback(JNIEnv* env, const char* className) {
+        auto& callback = detail::CompletionCallback::Instance();
+        std::lock_guard<std::mutex> lock(callback.mutex);
+        if (callback.cls.load(std::memory_order_acquire)) return;
+
+        jclass cls = FindClass(env, className);
+        ScopedLocalRef<jclass> clsRef(env, cls);
+        JNINativeMethod method{const_cast<char*>("complete"), const_cast<char*>("(JLjava/lang/Object;Ljava/lang/Throwable;)V"),
+                               reinterpret_cast<void*>(&detail::OnJavaCompletion)};
+        if (env->RegisterNatives(cls, &method, 1) != JNI_OK) {
+            JNI_CHECK_EXCEPTION(env);
+            throw JNIException("RegisterNatives failed");
+        }
+        callback.constructor = GetMethodID(env, cls, "<init>", "(J)V");
+
+        jclass stageClass = FindClass(env, "java/util/concurrent/CompletionStage");
+        ScopedLocalRef<jclass> stageClassRef(env, stageClass);
+        callback.whenComplete = GetMethodID(env, stageClass, "whenComplete",
+                                            "(Ljava/util/function/BiConsumer;)Ljava/util/concurrent/CompletionStage;");
+
+        jclass global = static_cast<jclass>(env->NewGlobalRef(cls));
+        if (!global) throw JNIException("NewGlobalRef failed");
+        callback.cls.store(global, std::memory_order_release);
+    }
+
+    // Java source of the callback class used by Await, for a JNI class name such as "com/example/NativeCompletion"
+    inline std::string GenerateCompletionCallbackJava(const std::string& className) {
+        size_t slash = className.rfind('/');
+        std::string packageName = slash == std::string::npos ? "" : className.substr(0, slash);
+        std::replace(packageName.begin(), packageName.end(), '/', '.');
+        std::string simpleName = slash == std::string::npos ? className : className.substr(slash + 1);
+
+        std::string out;
+        if (!packageName.empty()) out += "package " + packageName + ";\n\n";
+        out += "// Generated by jni::GenerateCompletionCallbackJava, do not edit\n";
+        out += "public final class " + simpleName + " implements java.util.function.BiConsumer<Object, Throwable> {\n";
+        out += "    private final long handle;\n\n";
+        out += "    " + simpleName + "(long handle) { this.handle = handle; }\n\n";
+        out += "    @Override\n";
+        out += "    public void accept(Object value, Throwable error) { complete(handle, value, error); }\n\n";
+        out += "    private static native void complete(long handle, Object value, Throwable error);\n";
+        out += "}\n";
+        return out;
+    }
+#endif
 } // namespace jni